@@ -0,0 +1,160 @@
+/*
+ ============================================================================
+ Name        : clevo-indicator-shm.h
+ Description : Layout of the telemetry shared memory of clevo-indicator
+
+ The worker publishes its telemetry in the POSIX shared memory segment
+ SHARE_NAME (/dev/shm/clevo-indicator), owned by root and readable by
+ everyone. Monitors map it read-only and could read it without any syscall
+ or EC access:
+
+ int fd = shm_open(SHARE_NAME, O_RDONLY, 0);
+ struct share_layout* share = mmap(NULL, sizeof(*share), PROT_READ,
+ MAP_SHARED, fd, 0);
+
+ Check magic, version and size before reading anything else; the version is
+ bumped on every incompatible layout change.
+
+ Latest sample, a seqlock: read sample_seq (acquire), retry while odd, copy
+ sample, fence (acquire), read sample_seq again and retry if it changed. The
+ sample version is sample_seq / 2.
+
+ History ring: history_head is the index of the next record to be written,
+ record i lives in history[i % EC_HISTORY_SIZE] and is valid while the seq of
+ its slot equals i + 1 before and after copying it.
+
+ The command ring is written by the indicator only and must not be touched.
+
+ Worker statistics are counters updated by the worker only, read them with
+ relaxed atomic loads; fields may be one tick apart from each other.
+ ============================================================================
+ */
+
+#ifndef CLEVO_INDICATOR_SHM_H
+#define CLEVO_INDICATOR_SHM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define SHARE_NAME "/clevo-indicator"
+#define SHARE_MAGIC 0x43455649 /* "IVEC" */
+#define SHARE_VERSION 8
+
+/* sensors and fans of the largest model profile, names are NUL-padded */
+#define EC_MAX_SENSORS 4
+#define EC_MAX_FANS 2
+#define EC_NAME_SIZE 8
+
+/* UI -> worker commands, single producer (UI) and single consumer (worker) */
+#define EC_COMMAND_RING_SIZE 16
+
+/* telemetry history, 4096 samples are 13 minutes at the fastest sampling
+ * interval */
+#define EC_HISTORY_SIZE 4096
+
+/* worker self-profiling: log-linear latency buckets of 4 per power of two,
+ * bucket i counts latencies from ec_stats_bucket_us(i) up to
+ * ec_stats_bucket_us(i + 1) microseconds, the last one up to infinity */
+#define EC_STATS_SUB_BUCKETS 4
+#define EC_STATS_BUCKETS (24 * EC_STATS_SUB_BUCKETS)
+
+/* EC port handshake phases: cmd, addr, data, read, done */
+#define EC_STATS_IO_PHASES 5
+
+/* phases of a worker tick, and the lateness of the timer wake-up */
+enum ec_stats_phase {
+    EC_STATS_READ = 0, /* EC registers from ec_sys or ports */
+    EC_STATS_DECODE, /* registers, hwmon and load signals into the sample */
+    EC_STATS_CONTROL, /* auto mode curve or PID */
+    EC_STATS_WRITE, /* fan duty writes */
+    EC_STATS_PUBLISH, /* shared memory, metrics and trace */
+    EC_STATS_JITTER, /* timer wake-up after the scheduled deadline */
+    EC_STATS_PHASES
+};
+
+static inline uint64_t ec_stats_bucket_us(int bucket) {
+    if (bucket < EC_STATS_SUB_BUCKETS)
+        return bucket;
+    int octave = bucket / EC_STATS_SUB_BUCKETS;
+    int sub = bucket % EC_STATS_SUB_BUCKETS;
+    return (uint64_t) (EC_STATS_SUB_BUCKETS + sub) << (octave - 1);
+}
+
+/* temps and fans in the order of sensor_names and fan_names */
+struct ec_sample {
+    int32_t sensor_count;
+    int32_t fan_count;
+    int32_t temps[EC_MAX_SENSORS];
+    int32_t fan_duty[EC_MAX_FANS];
+    int32_t fan_rpms[EC_MAX_FANS];
+    int32_t auto_duty;
+    int32_t auto_duty_val[EC_MAX_FANS]; /* last duty set by auto mode */
+    int32_t manual_duty; /* requested duty while auto_duty is 0 */
+    int32_t cpu_load; /* %, -1 if unavailable */
+    int32_t gpu_load; /* %, -1 if unavailable */
+    int32_t package_power_mw; /* RAPL package power, -1 if unavailable */
+    int32_t control; /* auto mode controller, 0 for the curve, 1 for PID */
+};
+
+struct ec_command {
+    int32_t type;
+    int32_t value;
+};
+
+struct ec_history_record {
+    uint64_t timestamp_ns; /* CLOCK_MONOTONIC */
+    int16_t temps[EC_MAX_SENSORS];
+    uint16_t fan_rpms[EC_MAX_FANS];
+    uint8_t fan_duty[EC_MAX_FANS];
+    uint8_t auto_duty;
+};
+
+/* seq is the history index + 1 once the record is complete, 0 while being
+ * written; two slots per 64-byte cache line */
+struct ec_history_slot {
+    atomic_uint seq;
+    struct ec_history_record record;
+} __attribute__((aligned(32)));
+
+struct ec_stats_histogram {
+    atomic_ullong count;
+    atomic_ullong sum_ns;
+    atomic_ullong max_ns;
+    atomic_ullong buckets[EC_STATS_BUCKETS];
+};
+
+struct ec_stats {
+    atomic_ullong ticks;
+    struct ec_stats_histogram phases[EC_STATS_PHASES];
+    atomic_ullong io_waits[EC_STATS_IO_PHASES];
+    atomic_ullong io_timeouts[EC_STATS_IO_PHASES];
+    atomic_ullong io_retries; /* EC port transactions repeated */
+    atomic_ullong io_failures; /* EC port transactions given up */
+    atomic_ullong samples_rejected; /* out of range EC readings */
+    atomic_ullong fan_writes_issued[EC_MAX_FANS];
+    atomic_ullong fan_writes_suppressed[EC_MAX_FANS];
+    atomic_ullong fan_writes_coalesced[EC_MAX_FANS];
+    atomic_ullong fan_writes_failed[EC_MAX_FANS];
+    atomic_ullong fan_writes_unverified[EC_MAX_FANS]; /* not read back */
+};
+
+struct share_layout {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size; /* sizeof(struct share_layout) */
+    uint32_t history_size;
+    char profile[32]; /* model profile of the register map */
+    char sensor_names[EC_MAX_SENSORS][EC_NAME_SIZE];
+    char fan_names[EC_MAX_FANS][EC_NAME_SIZE];
+    atomic_int exit;
+    atomic_uint sample_seq;
+    struct ec_sample sample;
+    atomic_uint command_head;
+    atomic_uint command_tail;
+    struct ec_command commands[EC_COMMAND_RING_SIZE];
+    struct ec_stats stats;
+    atomic_uint history_head;
+    struct ec_history_slot history[EC_HISTORY_SIZE] __attribute__((aligned(64)));
+};
+
+#endif /* CLEVO_INDICATOR_SHM_H */
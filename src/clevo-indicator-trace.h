@@ -0,0 +1,60 @@
+/*
+ ============================================================================
+ Name        : clevo-indicator-trace.h
+ Description : Format of the binary sample traces of clevo-indicator
+
+ With "trace_file" set, the worker records every sample to a trace file: one
+ struct trace_header followed by fixed-size struct trace_record entries, all
+ in host byte order. The previous trace is kept as "<trace_file>.1" when a
+ new one is started, at every worker start and when the size limit is hit.
+
+ Decode with "clevo-indicator --export-csv <trace>" or watch it again with
+ "clevo-indicator --replay <trace>".
+ ============================================================================
+ */
+
+#ifndef CLEVO_INDICATOR_TRACE_H
+#define CLEVO_INDICATOR_TRACE_H
+
+#include <stdint.h>
+
+#include "clevo-indicator-shm.h"
+
+#define TRACE_MAGIC 0x54564C43 /* "CLVT" */
+#define TRACE_VERSION 2
+
+#define TRACE_MODE_MANUAL 0
+#define TRACE_MODE_AUTO 1
+
+struct trace_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size; /* sizeof(struct trace_record) */
+    uint8_t sensor_count;
+    uint8_t fan_count;
+    uint8_t reserved[6];
+    uint64_t start_realtime_ns; /* CLOCK_REALTIME of start_monotonic_ns */
+    uint64_t start_monotonic_ns;
+    char profile[32];
+    char sensor_names[EC_MAX_SENSORS][EC_NAME_SIZE];
+    char fan_names[EC_MAX_FANS][EC_NAME_SIZE];
+};
+
+/* commanded is the duty requested by auto mode or the manual duty, 0 while
+ * auto mode keeps the current duty; loads are 255 and power is 0xFFFF when
+ * unavailable, and always 0 in version 1 traces */
+struct trace_record {
+    uint64_t timestamp_ns; /* CLOCK_MONOTONIC */
+    int16_t temps[EC_MAX_SENSORS];
+    uint16_t fan_rpms[EC_MAX_FANS];
+    uint8_t fan_duty[EC_MAX_FANS];
+    uint8_t commanded[EC_MAX_FANS];
+    uint8_t mode;
+    uint8_t cpu_load; /* % */
+    uint8_t gpu_load; /* % */
+    uint8_t reserved;
+    uint16_t package_power_dw; /* 0.1W */
+    uint8_t reserved2[2];
+};
+
+#endif /* CLEVO_INDICATOR_TRACE_H */
@@ -11,7 +11,7 @@
  ============================================================================
 
  TEST:
- gcc clevo-indicator.c -o clevo-indicator `pkg-config --cflags --libs appindicator3-0.1` -lm
+ gcc clevo-indicator.c -o clevo-indicator `pkg-config --cflags --libs appindicator3-0.1` -lm -lrt
  sudo chown root clevo-indicator
  sudo chmod u+s clevo-indicator
 
@@ -30,27 +30,70 @@
  ============================================================================
  */
 
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <dirent.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <grp.h>
 #include <math.h>
+#include <linux/netlink.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
 #include <sys/io.h>
 #include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <glib-unix.h>
 #include <libappindicator/app-indicator.h>
 
+#include "clevo-indicator-shm.h"
+#include "clevo-indicator-trace.h"
+
 #define NAME "clevo-indicator"
 
+#define CONFIG_PATH "/etc/" NAME ".conf"
+
+/* control socket of the worker, accessible to root and the adm group */
+#define SOCKET_PATH "/run/" NAME ".sock"
+#define LOCK_PATH "/run/" NAME ".lock"
+#define SOCKET_GROUP "adm"
+#define SOCKET_MAX_CLIENTS 8
+#define SOCKET_MAGIC 0xEC
+#define SOCKET_VERSION 6
+
+/* optional OpenMetrics endpoint and node_exporter textfile */
+#define METRICS_MAX_CLIENTS 4
+#define METRICS_BUF_SIZE 8192
+#define METRICS_TEXTFILE_INTERVAL_NS (5 * 1000000000ULL)
+
+/* log2 latency buckets from 1us up to 2^20us (~1s) */
+#define HISTOGRAM_BUCKETS 21
+
 #define EC_SC 0x66
 #define EC_DATA 0x62
 
@@ -60,50 +103,545 @@
 
 /* EC registers can be read by EC_SC_READ_CMD or /sys/kernel/debug/ec/ec0/io:
  *
- * 1. modprobe ec_sys
+ * 1. modprobe ec_sys (done by the worker)
  * 2. od -Ax -t x1 /sys/kernel/debug/ec/ec0/io
  */
 
+#define EC_SYSFS_IO "/sys/kernel/debug/ec/ec0/io"
+
+/* ec_sys is loaded without forking modprobe when it is not loaded or built
+ * in, modprobe stays the fallback for dependencies and unusual layouts; the
+ * io node may appear shortly after loading */
+#define EC_SYS_MODULE "/sys/module/ec_sys"
+#define EC_SYS_MODULE_FILE "/lib/modules/%s/kernel/drivers/acpi/ec_sys.ko%s"
+#define EC_SYSFS_WAIT_MS 2000
+#ifndef MODULE_INIT_COMPRESSED_FILE
+#define MODULE_INIT_COMPRESSED_FILE 4
+#endif
+
 #define EC_REG_SIZE 0x100
-#define EC_REG_CPU_TEMP 0x07
-#define EC_REG_GPU_TEMP 0xCD
-#define EC_REG_FAN_DUTY 0xCE
-#define EC_REG_FAN_RPMS_HI 0xD0
-#define EC_REG_FAN_RPMS_LO 0xD1
 
-#define MAX_FAN_RPM 4400.0
+/* model profile registers are in ec_profiles[], selected by the DMI board
+ * name or the "profile" setting */
+#define DMI_BOARD_NAME "/sys/class/dmi/id/board_name"
+
+/* leading load signals for feed-forward, CPU package domains and amdgpu
+ * cards are probed by index */
+#define PROC_STAT "/proc/stat"
+#define RAPL_ENERGY "/sys/class/powercap/intel-rapl:%d/energy_uj"
+#define RAPL_MAX_ENERGY "/sys/class/powercap/intel-rapl:%d/max_energy_range_uj"
+#define RAPL_MAX_PACKAGES 4
+#define DRM_GPU_BUSY "/sys/class/drm/card%d/device/gpu_busy_percent"
+#define DRM_MAX_CARDS 4
+
+/* hwmon chips and inputs are probed by index, a chip of each sensor is used */
+#define HWMON_NAME "/sys/class/hwmon/hwmon%d/name"
+#define HWMON_TEMP_INPUT "/sys/class/hwmon/hwmon%d/temp%d_input"
+#define HWMON_TEMP_LABEL "/sys/class/hwmon/hwmon%d/temp%d_label"
+#define HWMON_MAX_CHIPS 32
+#define HWMON_MAX_INDEX 64
+#define HWMON_MAX_INPUTS 16
+
+/* NVIDIA GPU temperature through NVML, loaded only if installed */
+#define NVML_LIBRARY "libnvidia-ml.so.1"
+#define NVML_TEMPERATURE_GPU 0
+
+/* feed-forward only counts load above idle */
+#define FEEDFORWARD_LOAD_IDLE 20
+
+/* sysfs ranges span gaps of this many unused registers instead of issuing
+ * another pread */
+#define EC_SYSFS_RANGE_GAP 1
+
+/* EC handshakes spin on inb() first, then back off from 10us to 1ms sleeps
+ * until the 100ms timeout */
+#define EC_IO_SPIN_COUNT 200
+#define EC_IO_BACKOFF_MIN_NS 10000
+#define EC_IO_BACKOFF_MAX_NS 1000000
+#define EC_IO_TIMEOUT_NS 100000000ULL
+
+/* a transaction with a timed out handshake is repeated up to 2 more times,
+ * 1ms then 2ms later */
+#define EC_IO_ATTEMPTS 3
+#define EC_IO_RETRY_BACKOFF_NS 1000000
+
+/* readings beyond these are transfer errors, 0xFF reads as 255°C */
+#define EC_MAX_VALID_TEMP 120
+#define EC_MAX_VALID_RPMS_PERCENT 150
+
+/* the duty register must report a written duty within 3 seconds */
+#define FAN_WRITE_VERIFY_NS 3000000000ULL
+
+/* range accepted by ec_write_fan_duty(), the worker and the command line */
+#define MIN_FAN_DUTY 60
+#define MAX_FAN_DUTY 100
+
+#define MAX_CURVE_POINTS 32
+
+/* longest median window of the sample filter */
+#define FILTER_MAX_MEDIAN 9
+
+/* minimal interval between two fan duty writes, a change takes 1-2 seconds to
+ * come into effect anyway */
+#define FAN_WRITE_INTERVAL_MS 1000
+
+#define BENCH_ITERATIONS 200
+
+/* trace records are buffered and written in batches of 4KB, at least every
+ * 5 seconds */
+#define TRACE_BUF_RECORDS 128
+#define TRACE_FLUSH_NS (5 * 1000000000ULL)
+#define TRACE_MAX_MB 64
+
+/* trend used by the PID derivative term */
+#define PID_TREND_WINDOW_NS (5 * 1000000000ULL)
+#define PID_TREND_RECORDS 64
+
+/* worker samples every 200ms while temperatures ramp and backs off up to 1s
+ * while they are stable; commands from the UI wake it up immediately */
+#define WORKER_INTERVAL_MIN_MS 200
+#define WORKER_INTERVAL_MAX_MS 1000
+#define WORKER_RAMP_DELTA 2
+
+/* on battery the worker samples every 1s while ramping and backs off up to
+ * battery_interval_ms */
+#define WORKER_BATTERY_INTERVAL_MIN_MS 1000
+#define WORKER_BATTERY_INTERVAL_MAX_MS 5000
+
+/* a suspend shows as CLOCK_BOOTTIME running ahead of CLOCK_MONOTONIC; after
+ * resume the EC readings settle for 2s before auto mode acts on them */
+#define RESUME_DRIFT_NS 1000000000ULL
+#define RESUME_SETTLE_NS 2000000000ULL
+
+#define POWER_SUPPLY_DIR "/sys/class/power_supply"
+
+/* thermal model of --simulate: every sensor is a heat capacity cooled to the
+ * ambient temperature through a conductance raised by the RPM of its fans,
+ * integrated in 100ms steps of trace time */
+#define SIM_AMBIENT 30.0 /* °C */
+#define SIM_HEAT_CAPACITY 30.0 /* J/°C */
+#define SIM_CONDUCTANCE_IDLE 0.3 /* W/°C with the fans stopped */
+#define SIM_CONDUCTANCE_FAN 0.9 /* W/°C added at the maximum RPM */
+#define SIM_FAN_TAU_S 1.5 /* lag of the RPM behind the duty */
+#define SIM_STEP_NS 100000000ULL
+#define SIM_SEED 1
+
+/* synthetic trace of --synthesize: 2 minutes idle and 2 minutes loaded in
+ * turn, recorded every 500ms with the fans at the minimum duty */
+#define SYNTH_IDLE_W 15.0
+#define SYNTH_LOAD_W 45.0
+#define SYNTH_PHASE_NS 120000000000ULL
+#define SYNTH_RECORD_NS 500000000ULL
+#define SYNTH_SECONDS 1200
+
+/* simulated EC handshakes take 50us per transaction by default */
+#define SIM_LATENCY_US 50
+#define SIM_THRESHOLD 60
 
 typedef enum {
-    NA = 0, AUTO = 1, MANUAL = 2
+    NA = 0, AUTO = 1, MANUAL = 2, INFO = 3, FANS = 4, CONTROL = 5
 } MenuItemType;
 
+typedef enum {
+    EC_COMMAND_AUTO = 1, EC_COMMAND_MANUAL = 2, EC_COMMAND_CONTROL = 3
+} EcCommandType;
+
+typedef enum {
+    CONTROL_CURVE = 0, CONTROL_PID = 1
+} ControlMode;
+
+typedef enum {
+    TEMP_SOURCE_FUSED = 0, TEMP_SOURCE_HWMON = 1, TEMP_SOURCE_EC = 2
+} TempSource;
+
+typedef enum {
+    SOCKET_OP_GET = 1, SOCKET_OP_AUTO = 2, SOCKET_OP_DUTY = 3
+} SocketOp;
+
+typedef enum {
+    EC_IO_PHASE_CMD = 0,
+    EC_IO_PHASE_ADDR,
+    EC_IO_PHASE_DATA,
+    EC_IO_PHASE_READ,
+    EC_IO_PHASE_DONE,
+    EC_IO_PHASE_COUNT
+} EcIoPhase;
+
+/* temperature register in °C */
+struct ec_sensor_desc {
+    const char* name;
+    uint8_t reg;
+};
+
+/* duty register (0-255), tachometer registers with rpm = rpm_factor / period
+ * and the port of the duty write command 0x99; sensor_mask has bit i set for
+ * sensors[i] */
+struct ec_fan_desc {
+    const char* name;
+    unsigned sensor_mask; /* sensors driving the fan in auto mode */
+    uint8_t duty_reg;
+    uint8_t rpms_hi_reg;
+    uint8_t rpms_lo_reg;
+    uint8_t write_port;
+    int rpm_factor;
+    int max_rpms;
+};
+
+/* board_names lists DMI board name prefixes separated by spaces, NULL for
+ * profiles only selected by the "profile" setting; only register maps
+ * confirmed on hardware are listed, the duty write command is sent as is */
+struct ec_profile {
+    const char* name;
+    const char* board_names;
+    int sensor_count;
+    struct ec_sensor_desc sensors[EC_MAX_SENSORS];
+    int fan_count;
+    struct ec_fan_desc fans[EC_MAX_FANS];
+};
+
+struct curve_point {
+    int temp;
+    int duty;
+};
+
+/* fan curve precompiled into temperature -> duty lookup tables, speeding up
+ * by "up" and slowing down by "down" which is shifted by the hysteresis */
+struct fan_curve {
+    uint8_t up[256];
+    uint8_t down[256];
+};
+
+/* integral is kept in duty percents so anti-windup can clamp it directly */
+struct pid_state {
+    double integral;
+    uint64_t last_ns;
+};
+
+/* auto mode of one fan, driven by the hottest of its sensors */
+struct fan_control {
+    struct fan_curve curve;
+    struct pid_state pid;
+    unsigned sensor_mask;
+};
+
+/* persistent descriptors read by pread each tick, with the previous counters
+ * to compute rates */
+struct load_sampler {
+    int stat_fd;
+    int rapl_fds[RAPL_MAX_PACKAGES];
+    uint64_t rapl_ranges[RAPL_MAX_PACKAGES];
+    uint64_t rapl_energies[RAPL_MAX_PACKAGES];
+    int gpu_fd;
+    uint64_t busy;
+    uint64_t total;
+    uint64_t last_ns;
+};
+
+/* temperature inputs of a profile sensor outside of the EC, the hottest one
+ * is its reading */
+struct hwmon_source {
+    char chip[16];
+    int fds[HWMON_MAX_INPUTS];
+    int count;
+    int nvml;
+};
+
+/* median of the last readings, then slew-rate clamp, then a time-based EMA;
+ * one per temperature and per fan RPM */
+struct sample_filter {
+    int window[FILTER_MAX_MEDIAN];
+    int count;
+    int next;
+    int initialized;
+    double slewed;
+    double smoothed;
+};
+
+/* per-fan settings by fan name, matched to the profile after loading */
+struct fan_config {
+    char name[EC_NAME_SIZE];
+    struct curve_point curve_points[MAX_CURVE_POINTS];
+    int curve_point_count; /* 0 for the common curve */
+    char sensors[64]; /* sensor names, empty for the profile binding */
+};
+
+/* pending duty is coalesced until the minimal write interval has passed and
+ * suppressed if the EC already reports it */
+struct fan_writer {
+    int pending;
+    uint64_t last_write_ns;
+    int verify_duty; /* last written duty until the EC reports it, or 0 */
+    int reapplied; /* the unverified duty was written once more */
+    uint64_t issued;
+    uint64_t suppressed;
+    uint64_t coalesced;
+    uint64_t failed;
+    uint64_t unverified;
+};
+
+struct ec_io_errors {
+    uint64_t retries;
+    uint64_t failures;
+    uint64_t rejected;
+};
+
+/* EC access of the worker, the laptop's EC through ec_sys or the ports, or
+ * the thermal model of --simulate */
+struct ec_backend {
+    int (*read_registers)(uint8_t* buf);
+    int (*write_fan_duty)(int fan, uint8_t raw_duty);
+    uint64_t (*clock)(void); /* CLOCK_MONOTONIC or the simulated clock */
+    void (*read_loads)(struct ec_sample* sample, uint64_t now_ns);
+};
+
+/* carried from one worker tick to the next; ec_raw holds the decoded EC
+ * readings before fusion and filtering */
+struct worker_state {
+    struct ec_sample sample;
+    struct ec_sample published;
+    struct ec_sample ec_raw;
+    uint8_t prev_buf[EC_REG_SIZE];
+    int decoded;
+    int interval_ms;
+    int prev_temp;
+    int settling; /* after resume, auto mode and writes are held */
+    int quiet; /* no log of duty changes and read errors */
+};
+
+struct latency_histogram {
+    uint64_t buckets[HISTOGRAM_BUCKETS + 1]; /* last one is +Inf */
+    uint64_t count;
+    uint64_t sum_ns;
+};
+
+struct ec_io_phase_stats {
+    uint64_t count;
+    uint64_t timeouts;
+    uint64_t spun; /* completed without sleeping */
+    uint64_t sleeps;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+#define EC_HISTORY_PEAK_NS (60 * 1000000000ULL)
+#define UI_PEAK_DELAY_MAX_MS 60000
+
+/* history window: one column per second, 10 minutes across */
+#define UI_GRAPH_WIDTH 600
+#define UI_GRAPH_HEIGHT 160
+#define UI_GRAPH_COLUMN_NS 1000000000ULL
+#define UI_GRAPH_TEMP_MIN 20
+#define UI_GRAPH_TEMP_MAX 100
+
+/* binary protocol of the control socket: a request starts with SOCKET_MAGIC,
+ * which tells it apart from text lines ("get", "auto" or "duty <percentage>"),
+ * and is answered by a response carrying the latest sample */
+struct socket_request {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t op;
+    uint8_t reserved;
+    int32_t value;
+};
+
+struct socket_response {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t op;
+    uint8_t status; /* 0 or errno */
+    uint32_t sample_version;
+    struct ec_sample sample;
+};
+
+struct socket_client {
+    int fd;
+    int len;
+    char buf[128];
+};
+
 static void main_init_share(void);
 static int main_ec_worker(void);
+static int main_ec_worker_wait(int timer_fd, uint64_t deadline_ns,
+        struct ec_sample* sample);
+static uint64_t worker_tick(const struct ec_backend* backend,
+        struct worker_state* state);
+static int main_ec_worker_command(struct ec_sample* sample,
+        const struct ec_command* command);
+static void main_notify_worker(void);
+static void main_notify_ui(const struct ec_sample* sample,
+        const struct ec_sample* prev_sample);
 static void main_ui_worker(int argc, char** argv);
 static void main_on_sigchld(int signum);
 static void main_on_sigterm(int signum);
+static void share_publish_sample(const struct ec_sample* sample);
+static unsigned share_read_sample(struct ec_sample* sample);
+static unsigned share_sample_version(void);
+static int share_push_command(int type, int value);
+static int share_pop_command(struct ec_command* command);
+static void share_append_history(const struct ec_sample* sample,
+        uint64_t timestamp_ns);
+static int share_map_readonly(void);
+static int share_read_history(unsigned since,
+        struct ec_history_record* records, int max, unsigned* next);
 static int main_dump_fan(void);
+static int main_dump_share(void);
+static int main_stats(void);
+static void main_print_sample(const struct ec_sample* sample,
+        const char* const * sensor_names, const char* const * fan_names);
 static int main_test_fan(int duty_percentage);
+static int main_bench(int iterations);
+static void main_bench_report(const char* name, uint64_t* samples, int count);
+static int compare_uint64(const void* a, const void* b);
 static gboolean ui_update(gpointer user_data);
+static gboolean ui_on_event(gint fd, GIOCondition condition,
+        gpointer user_data);
+static gboolean ui_on_peak_timeout(gpointer user_data);
 static void ui_command_set_fan(long fan_duty);
+static void ui_command_set_control(long control);
+static void ui_command_history(gchar* command);
 static void ui_command_quit(gchar* command);
-static void ui_toggle_menuitems(int fan_duty);
+static void ui_toggle_menuitems(int fan_duty, int control);
+static void ui_update_fans(const struct ec_sample* sample);
+static void ui_graph_update(void);
+static void ui_graph_draw_column(int x);
+static gboolean ui_graph_on_draw(GtkWidget* widget, cairo_t* cr,
+        gpointer user_data);
+static gboolean ui_graph_on_timeout(gpointer user_data);
+static void ui_graph_on_hide(GtkWidget* widget, gpointer user_data);
+static void ui_update_peak(void);
 static void ec_on_sigterm(int signum);
 static int ec_init(void);
-static int ec_auto_duty_adjust(void);
-static int ec_query_cpu_temp(void);
-static int ec_query_gpu_temp(void);
-static int ec_query_fan_duty(void);
-static int ec_query_fan_rpms(void);
-static int ec_write_fan_duty(int duty_percentage);
-static int ec_io_wait(const uint32_t port, const uint32_t flag,
-        const char value);
-static uint8_t ec_io_read(const uint32_t port);
+static int ec_sysfs_open(void);
+static int ec_sysfs_prepare(void);
+static int ec_sysfs_load_module(void);
+static int ec_sysfs_wait(int timeout_ms);
+static ssize_t ec_sysfs_read(uint8_t* buf);
+static int ec_auto_duty_adjust(const struct ec_sample* sample, int fan,
+        uint64_t now_ns);
+static int control_curve(const struct ec_sample* sample, int fan);
+static double control_feedforward(const struct ec_sample* sample, int fan);
+static int control_pid(const struct ec_sample* sample, int fan,
+        uint64_t now_ns);
+static void control_reset(void);
+static double history_temp_slope(const struct ec_sample* sample,
+        unsigned sensor_mask, uint64_t now_ns, uint64_t window_ns);
+static void curve_compile(struct fan_curve* curve,
+        const struct curve_point* points, int count, int step, int hysteresis);
+static int curve_parse(const char* text, struct curve_point* points, int max);
+static const struct ec_profile* profile_select(const char* name);
+static void profile_compile(const struct ec_profile* profile);
+static int sample_max_temp(const struct ec_sample* sample);
+static int sample_fan_temp(const struct ec_sample* sample, int fan);
+static void load_open(void);
+static void load_close(void);
+static void load_sample(struct ec_sample* sample, uint64_t now_ns);
+static int load_read_u64(int fd, uint64_t* value);
+static void filter_apply(struct ec_sample* sample, const int* fan_rpms,
+        uint64_t now_ns);
+static int filter_value(struct sample_filter* filter, int input, double dt_s,
+        double slew);
+static void filter_reset(void);
+static void worker_realtime(void);
+static int worker_interval(int interval_ms, int ramping);
+static void power_open(void);
+static void power_close(void);
+static void power_read_online(void);
+static void power_read_uevents(void);
+static uint64_t power_resumed(void);
+static uint64_t get_boottime_ns(void);
+static void hwmon_open(void);
+static void hwmon_close(void);
+static void hwmon_fuse(struct ec_sample* sample, const int* ec_temps);
+static int hwmon_read(const struct hwmon_source* source);
+static int hwmon_is_package(int chip, int input);
+static int nvml_open(void);
+static int nvml_read(void);
+static int ec_hw_read_registers(uint8_t* buf);
+static int ec_hw_write_fan_duty(int fan, uint8_t raw_duty);
+static int ec_registers_changed(const uint8_t* buf, uint8_t* prev_buf);
+static void ec_decode_sample(const uint8_t* buf, struct ec_sample* sample);
+static int ec_query_sample(struct ec_sample* sample);
+static int ec_write_fan_duty(const struct ec_backend* backend, int fan,
+        int duty_percentage);
+static void fan_writer_request(struct fan_writer* writer, int duty);
+static uint64_t fan_writer_flush(const struct ec_backend* backend,
+        struct fan_writer* writer, int fan, int raw_duty, uint64_t now_ns,
+        int quiet);
+static int ec_io_wait(const EcIoPhase phase, const uint32_t port,
+        const uint32_t flag, const char value);
+static void ec_io_print_stats(void);
+static int ec_io_read(const uint32_t port, uint8_t* value);
+static int ec_io_read_once(const uint32_t port, uint8_t* value);
+static int ec_io_do_once(const uint32_t cmd, const uint32_t port,
+        const uint8_t value);
+static void ec_io_retry_wait(int attempt);
+static int ec_registers_valid(const uint8_t* buf, int quiet);
+static int ec_io_read_registers(const uint8_t* regs, int count, uint8_t* buf);
 static int ec_io_do(const uint32_t cmd, const uint32_t port,
         const uint8_t value);
 static int calculate_fan_duty(int raw_duty);
-static int calculate_fan_rpms(int raw_rpm_high, int raw_rpm_low);
-static int check_proc_instances(const char* proc_name);
+static int calculate_raw_duty(int duty_percentage);
+static int calculate_fan_rpms(const struct ec_fan_desc* fan, int raw_rpm_high,
+        int raw_rpm_low);
+static int socket_open(void);
+static void socket_close(void);
+static void socket_accept(void);
+static int socket_client_read(struct socket_client* client,
+        struct ec_sample* sample);
+static int socket_client_binary(struct socket_client* client,
+        const struct socket_request* request, struct ec_sample* sample);
+static int socket_client_text(struct socket_client* client, char* line,
+        struct ec_sample* sample);
+static void socket_client_send(struct socket_client* client, const void* buf,
+        size_t len);
+static int metrics_open(const char* listen_addr);
+static void metrics_close(void);
+static void metrics_accept(void);
+static void metrics_client_read(struct socket_client* client);
+static void metrics_render(const struct ec_sample* sample, uint64_t now_ns);
+static int metrics_render_histogram(char* buf, size_t size, const char* name,
+        const char* help, const struct latency_histogram* histogram);
+static void metrics_append(char** p, char* end, const char* format, ...)
+        __attribute__((format(printf, 3, 4)));
+static void metrics_write_textfile(const char* path);
+static void stats_record(enum ec_stats_phase phase, uint64_t ns);
+static void stats_phase_end(enum ec_stats_phase phase, uint64_t* begin_ns,
+        uint64_t now_ns);
+static void stats_update_counters(void);
+static uint64_t stats_percentile_us(const struct ec_stats_histogram* histogram,
+        double quantile);
+static void histogram_record(struct latency_histogram* histogram,
+        uint64_t ns);
+static int trace_open(const char* path);
+static void trace_append(const struct ec_sample* sample, uint64_t now_ns);
+static void trace_flush(void);
+static void trace_close(void);
+static int main_offline(int argc, char* argv[]);
+static int main_drop_privileges(void);
+static int main_trace_read(const char* path, int replay, double speed);
+static int trace_read_header(FILE* fp, struct trace_header* header);
+static int main_simulate(const char* path, const char* config_path);
+static int main_synthesize(const char* path, int seconds);
+static void sim_run(void);
+static void sim_advance(void);
+static double sim_heat(int sensor);
+static double sim_conductance(int sensor, const double* fan_fractions);
+static void sim_load(struct ec_sample* sample, uint64_t now_ns);
+static uint64_t sim_clock(void);
+static int sim_transaction(void);
+static int sim_read_registers(uint8_t* buf);
+static int sim_write_fan_duty(int fan, uint8_t raw_duty);
+static void sim_report(const char* name, uint64_t duration_ns);
+static int config_load(const char* path);
+static int config_parse(const char* key, const char* value);
+static int config_parse_double(const char* value, double min, double max,
+        double* result);
+static struct fan_config* config_fan(const char* name);
+static void config_apply_fans(void);
+static int main_lock(void);
+static int main_forward_command(const char* line);
+static uint64_t get_monotonic_ns(void);
+static uint64_t get_thread_cpu_ns(void);
 static void get_time_string(char* buffer, size_t max, const char* format);
 static void signal_term(__sighandler_t handler);
 
@@ -117,7 +655,15 @@ struct {
     GtkWidget* widget;
 
 }static menuitems[] = {
+        { "Peak 1 min: -", NULL, 0L, INFO, NULL },
+        { "", NULL, 0L, FANS, NULL },
+        { "Show History", G_CALLBACK(ui_command_history), 0L, NA, NULL },
+        { "", NULL, 0L, NA, NULL },
         { "Set FAN to AUTO", G_CALLBACK(ui_command_set_fan), 0, AUTO, NULL },
+        { "Auto by Curve", G_CALLBACK(ui_command_set_control), CONTROL_CURVE,
+                CONTROL, NULL },
+        { "Auto by PID", G_CALLBACK(ui_command_set_control), CONTROL_PID,
+                CONTROL, NULL },
         { "", NULL, 0L, NA, NULL },
         { "Set FAN to  60%", G_CALLBACK(ui_command_set_fan), 60, MANUAL, NULL },
         { "Set FAN to  70%", G_CALLBACK(ui_command_set_fan), 70, MANUAL, NULL },
@@ -130,41 +676,263 @@ struct {
 
 static int menuitem_count = (sizeof(menuitems) / sizeof(menuitems[0]));
 
-struct {
-    volatile int exit;
-    volatile int cpu_temp;
-    volatile int gpu_temp;
-    volatile int fan_duty;
-    volatile int fan_rpms;
-    volatile int auto_duty;
-    volatile int auto_duty_val;
-    volatile int manual_next_fan_duty;
-    volatile int manual_prev_fan_duty;
-}static *share_info = NULL;
+/* sample is written by the worker under the seqlock sample_seq (odd while
+ * writing), commands are queued by the UI and drained by the worker, history
+ * is appended by the worker at history_head */
+static struct share_layout* share_info = NULL;
+
+static size_t share_size = 0;
 
 static pid_t parent_pid = 0;
 
+static int worker_event_fd = -1;
+
+/* signaled by the worker when the displayed values changed */
+static int ui_event_fd = -1;
+
+static guint ui_peak_source = 0;
+
+/* one info item per fan of the profile, in place of the FANS entry */
+static GtkWidget* ui_fan_items[EC_MAX_FANS];
+
+/* columns are drawn once into a ring surface, column c at x = c % width, and
+ * the window blits it in two parts; the timer only runs while it is shown */
+static struct {
+    GtkWidget* window;
+    GtkWidget* area;
+    cairo_surface_t* surface;
+    uint64_t column; /* index of the column being accumulated, 0 if none */
+    int temps[EC_MAX_SENSORS]; /* maxima of that column */
+    int duty;
+    int prev_temps[EC_MAX_SENSORS]; /* of the previous column, -1 if none */
+    unsigned history_next;
+    guint timer;
+} ui_graph;
+
+static const double ui_graph_colors[EC_MAX_SENSORS][3] = { { 1.0, 0.4, 0.2 },
+        { 0.3, 0.8, 0.3 }, { 0.3, 0.6, 1.0 }, { 0.9, 0.9, 0.3 } };
+
+/* the first profile is the default, the original single fan layout of the
+ * W350SSQ/W370SS chassis: od -Ax -t x1 /sys/kernel/debug/ec/ec0/io */
+static const struct ec_profile ec_profiles[] = {
+        { "clevo", "W35xSS_370SS",
+                2, { { "cpu", 0x07 }, { "gpu", 0xCD } },
+                1, { { "cpu", 0x3, 0xCE, 0xD0, 0xD1, 0x01, 2156220, 4400 } } }
+};
+
+static int ec_profile_count = (sizeof(ec_profiles) / sizeof(ec_profiles[0]));
+
+static const struct ec_profile* ec_profile = &ec_profiles[0];
+
+/* registers decoded by the worker, read from ec_sys by range instead of
+ * the whole 256-byte map: ec_sys performs one EC transaction per byte read;
+ * both are compiled from the profile */
+static struct {
+    uint8_t offset;
+    uint8_t length;
+} ec_sysfs_ranges[EC_MAX_SENSORS + 3 * EC_MAX_FANS];
+
+static int ec_sysfs_range_count = 0;
+
+static int ec_sysfs_fd = -1;
+
+/* registers decoded into struct ec_sample, for reading by EC ports */
+static uint8_t ec_sample_regs[EC_MAX_SENSORS + 3 * EC_MAX_FANS];
+
+static int ec_sample_reg_count = 0;
+
+static const char* ec_io_phase_names[EC_IO_PHASE_COUNT] = { "cmd", "addr",
+        "data", "read", "done" };
+
+static struct ec_io_phase_stats ec_io_stats[EC_IO_PHASE_COUNT];
+
+static struct ec_io_errors ec_io_errors;
+
+static const struct ec_backend ec_backend_hw = { ec_hw_read_registers,
+        ec_hw_write_fan_duty, get_monotonic_ns, load_sample };
+
+static const struct ec_backend ec_backend_sim = { sim_read_registers,
+        sim_write_fan_duty, sim_clock, sim_load };
+
+static const char* stats_phase_names[EC_STATS_PHASES] = { "read", "decode",
+        "control", "write", "publish", "jitter" };
+
+/* settings from CONFIG_PATH, defaults reproduce the original 10°C ladder */
+static struct {
+    struct curve_point curve_points[MAX_CURVE_POINTS];
+    int curve_point_count;
+    int curve_step;
+    int curve_hysteresis;
+    ControlMode control;
+    double pid_setpoint;
+    double pid_kp;
+    double pid_ki;
+    double pid_kd;
+    int pid_duty_step;
+    double feedforward_load;
+    double feedforward_power;
+    double feedforward_power_idle;
+    TempSource temp_source;
+    int temp_nvml; /* GPU temperature from NVML, keeps the GPU awake */
+    int fan_write_interval_ms;
+    int battery_interval_ms;
+    int filter_median; /* window size, 1 for none */
+    double filter_ema_ms; /* time constant, 0 for none */
+    double filter_slew; /* °C per second, 0 for none */
+    int worker_priority; /* SCHED_FIFO or SCHED_RR priority, 0 for normal */
+    int worker_policy;
+    int worker_cpu; /* -1 for any */
+    int worker_mlock;
+    const struct ec_profile* profile;
+    struct fan_config fans[EC_MAX_FANS];
+    char metrics_listen[64];
+    char metrics_textfile[256];
+    char trace_file[256];
+    int trace_max_mb;
+    double simulate_latency_us;
+    double simulate_failure_rate; /* of every EC transaction attempt */
+    double simulate_threshold; /* °C */
+} config = {
+        .curve_points = { { 10, 30 }, { 20, 40 }, { 30, 50 }, { 40, 60 },
+                { 50, 70 }, { 60, 80 }, { 70, 90 }, { 80, 100 } },
+        .curve_point_count = 8,
+        .curve_step = 1,
+        .curve_hysteresis = 5,
+        .control = CONTROL_CURVE,
+        .pid_setpoint = 60.0,
+        .pid_kp = 3.0,
+        .pid_ki = 0.1,
+        .pid_kd = 10.0,
+        .pid_duty_step = 5,
+        .feedforward_power_idle = 10.0,
+        .fan_write_interval_ms = FAN_WRITE_INTERVAL_MS,
+        .battery_interval_ms = WORKER_BATTERY_INTERVAL_MAX_MS,
+        .filter_median = 1,
+        .worker_policy = SCHED_FIFO,
+        .worker_cpu = -1,
+        .trace_max_mb = TRACE_MAX_MB,
+        .simulate_latency_us = SIM_LATENCY_US,
+        .simulate_threshold = SIM_THRESHOLD
+};
+
+static struct fan_control fan_controls[EC_MAX_FANS];
+
+static struct load_sampler load_sampler = { .stat_fd = -1, .gpu_fd = -1 };
+
+static struct hwmon_source hwmon_sources[EC_MAX_SENSORS];
+
+static struct sample_filter temp_filters[EC_MAX_SENSORS];
+static struct sample_filter rpm_filters[EC_MAX_FANS];
+static uint64_t filter_last_ns;
+
+/* AC adapter state from its "online" attribute, re-read on power_supply
+ * uevents */
+static struct {
+    int uevent_fd;
+    int online_fd;
+    int on_battery;
+    uint64_t sleep_offset_ns;
+} power = { .uevent_fd = -1, .online_fd = -1 };
+static struct {
+    void* library;
+    void* device;
+    int (*shutdown)(void);
+    int (*get_temperature)(void* device, int sensor, unsigned int* temp);
+} nvml;
+
+static struct fan_writer fan_writers[EC_MAX_FANS];
+
+static int socket_fd = -1;
+
+static struct socket_client socket_clients[SOCKET_MAX_CLIENTS];
+
+static int metrics_fd = -1;
+
+static struct socket_client metrics_clients[METRICS_MAX_CLIENTS];
+
+/* response rendered once per sample, a scrape only sends it */
+static char metrics_header[128];
+static char metrics_body[METRICS_BUF_SIZE];
+static int metrics_header_len = 0;
+static int metrics_body_len = 0;
+static uint64_t metrics_textfile_ns = 0;
+
+static struct latency_histogram ec_read_histogram;
+
+static int trace_fd = -1;
+
+static struct trace_record trace_buf[TRACE_BUF_RECORDS];
+static int trace_count = 0;
+static uint64_t trace_size = 0;
+static uint64_t trace_flush_ns = 0;
+
+/* trace replayed by --simulate, read whole so every controller runs on the
+ * same records */
+static struct {
+    struct trace_header header;
+    struct trace_record* records;
+    size_t count;
+} sim_trace;
+
+/* model state in trace time: now_ns is the simulated clock, advanced by the
+ * worker ticks and the EC transactions, model_ns how far the model has been
+ * integrated */
+static struct {
+    uint64_t now_ns;
+    uint64_t model_ns;
+    size_t index; /* record of model_ns */
+    double temps[EC_MAX_SENSORS];
+    double fan_rpms[EC_MAX_FANS];
+    uint8_t raw_duty[EC_MAX_FANS];
+    unsigned seed;
+    uint64_t above_ns;
+    double max_temp;
+    double duty_s; /* mean fan duty integrated over seconds */
+    uint64_t ticks;
+    uint64_t cpu_ns;
+} sim;
+
 int main(int argc, char* argv[]) {
+    // traces are decoded without touching the EC or the running instance
+    int offline = main_offline(argc, argv);
+    if (offline >= 0)
+        return offline;
+    if (argc > 1 && strcmp(argv[1], "--stats") == 0)
+        return main_stats();
     printf("Simple fan control utility for Clevo laptops\n");
-    if (check_proc_instances(NAME) > 1) {
-        printf("Multiple running instances!\n");
-        char* display = getenv("DISPLAY");
-        if (display != NULL && strlen(display) > 0) {
-            int desktop_uid = getuid();
-            setuid(desktop_uid);
-            //
-            gtk_init(&argc, &argv);
-            GtkWidget* dialog = gtk_message_dialog_new(NULL, 0,
-                    GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
-                    "Multiple running instances of %s!", NAME);
-            gtk_dialog_run(GTK_DIALOG(dialog));
-            gtk_widget_destroy(dialog);
-        }
+    // a running instance owns the EC, commands and dumps go through it
+    int running = main_lock() != EXIT_SUCCESS;
+    if (running && errno != EWOULDBLOCK) {
+        printf("unable to lock %s: %s\n", LOCK_PATH, strerror(errno));
         return EXIT_FAILURE;
     }
-    if (ec_init() != EXIT_SUCCESS) {
-        printf("unable to control EC: %s\n", strerror(errno));
-        return EXIT_FAILURE;
+    if (running) {
+        char* display = getenv("DISPLAY");
+        int headless = display == NULL || strlen(display) == 0;
+        if (argc <= 1 && headless)
+            return main_dump_share();
+        if (argc <= 1 || strcmp(argv[1], "--daemon") == 0
+                || strcmp(argv[1], "--bench") == 0) {
+            printf("Multiple running instances!\n");
+            if (!headless) {
+                int desktop_uid = getuid();
+                setuid(desktop_uid);
+                //
+                gtk_init(&argc, &argv);
+                GtkWidget* dialog = gtk_message_dialog_new(NULL, 0,
+                        GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
+                        "Multiple running instances of %s!", NAME);
+                gtk_dialog_run(GTK_DIALOG(dialog));
+                gtk_widget_destroy(dialog);
+            }
+            return EXIT_FAILURE;
+        }
+    } else {
+        if (ec_init() != EXIT_SUCCESS) {
+            printf("unable to control EC: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        config_load(CONFIG_PATH);
     }
     if (argc <= 1) {
         char* display = getenv("DISPLAY");
@@ -183,6 +951,7 @@ int main(int argc, char* argv[]) {
             } else if (worker_pid > 0) {
                 main_ui_worker(argc, argv);
                 share_info->exit = 1;
+                main_notify_worker();
                 waitpid(worker_pid, NULL, 0);
             } else {
                 printf("unable to create worker: %s\n", strerror(errno));
@@ -190,15 +959,41 @@ int main(int argc, char* argv[]) {
             }
         }
     } else {
-        if (argv[1][0] == '-') {
+        if (strcmp(argv[1], "--daemon") == 0) {
+            main_init_share();
+            signal_term(&ec_on_sigterm);
+            return main_ec_worker();
+        } else if (strcmp(argv[1], "--bench") == 0) {
+            int iterations = argc > 2 ? atoi(argv[2]) : BENCH_ITERATIONS;
+            if (iterations <= 0) {
+                printf("invalid iteration count %s!\n", argv[2]);
+                return EXIT_FAILURE;
+            }
+            return main_bench(iterations);
+        } else if (argv[1][0] == '-') {
             printf(
                     "\n\
-Usage: clevo-indicator [fan-duty-percentage]\n\
+Usage: clevo-indicator [fan-duty-percentage|auto]\n\
+       clevo-indicator --daemon\n\
+       clevo-indicator --bench [iterations]\n\
+       clevo-indicator --stats\n\
+       clevo-indicator --export-csv <trace>\n\
+       clevo-indicator --replay <trace> [speed]\n\
+       clevo-indicator --simulate <trace> [config]\n\
+       clevo-indicator --synthesize <trace> [seconds]\n\
 \n\
 Dump/Control fan duty on Clevo laptops. Display indicator by default.\n\
 \n\
 Arguments:\n\
-  [fan-duty-percentage]\t\tTarget fan duty in percentage, from 40 to 100\n\
+  [fan-duty-percentage]\t\tTarget fan duty in percentage, from %d to %d\n\
+  auto\t\t\t\tReturn the running instance to auto mode\n\
+  --daemon\t\t\tRun auto fan control without indicator\n\
+  --bench [iterations]\t\tMeasure EC read and write latency\n\
+  --stats\t\t\tShow worker latencies of the running instance\n\
+  --export-csv <trace>\t\tPrint a recorded trace as CSV\n\
+  --replay <trace> [speed]\tPlay a recorded trace back in its own timing\n\
+  --simulate <trace> [config]\tCompare auto mode controllers on a trace\n\
+  --synthesize <trace> [seconds]\tWrite a square load trace to simulate\n\
   -?\t\t\t\tDisplay this help and exit\n\
 \n\
 Without arguments this program should attempt to display an indicator in\n\
@@ -221,16 +1016,34 @@ module 'ec_sys', in order to query EC information from\n\
 which may be more risky if interrupted or concurrently operated during the\n\
 process.\n\
 \n\
+The auto fan curve can be configured in " CONFIG_PATH ".\n\
+\n\
+While the indicator or daemon is running, " SOCKET_PATH " accepts\n\
+\"get\", \"stats\", \"auto\", \"duty <percentage>\" and \"control <curve|pid>\"\n\
+lines for fan information and control. Running this program with a fan duty\n\
+or \"auto\" then forwards it to the running instance, and a dump shows its\n\
+latest sample.\n\
+\n\
 DO NOT MANIPULATE OR QUERY EC I/O PORTS WHILE THIS PROGRAM IS RUNNING.\n\
-\n");
-            return main_dump_fan();
+\n", MIN_FAN_DUTY, MAX_FAN_DUTY);
+            return running ? main_dump_share() : main_dump_fan();
+        } else if (strcmp(argv[1], "auto") == 0) {
+            if (!running) {
+                printf("auto mode needs a running indicator or daemon!\n");
+                return EXIT_FAILURE;
+            }
+            return main_forward_command("auto\n");
         } else {
             int val = atoi(argv[1]);
-            if (val < 40 || val > 100)
-                    {
+            if (val < MIN_FAN_DUTY || val > MAX_FAN_DUTY) {
                 printf("invalid fan duty %d!\n", val);
                 return EXIT_FAILURE;
             }
+            if (running) {
+                char line[32];
+                snprintf(line, sizeof(line), "duty %d\n", val);
+                return main_forward_command(line);
+            }
             return main_test_fan(val);
         }
     }
@@ -238,82 +1051,368 @@ DO NOT MANIPULATE OR QUERY EC I/O PORTS WHILE THIS PROGRAM IS RUNNING.\n\
 }
 
 static void main_init_share(void) {
-    void* shm = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
-            -1, 0);
+    long page_size = sysconf(_SC_PAGESIZE);
+    share_size = (sizeof(*share_info) + page_size - 1) / page_size * page_size;
+    // only one instance is running, so an existing segment is stale
+    shm_unlink(SHARE_NAME);
+    int shm_fd = shm_open(SHARE_NAME, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+            0644);
+    if (shm_fd < 0 || ftruncate(shm_fd, share_size) != 0) {
+        printf("unable to create shared memory: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    void* shm = mmap(NULL, share_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            shm_fd, 0);
+    close(shm_fd);
+    if (shm == MAP_FAILED) {
+        printf("unable to map shared memory: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
     share_info = shm;
-    share_info->exit = 0;
-    share_info->cpu_temp = 0;
-    share_info->gpu_temp = 0;
-    share_info->fan_duty = 0;
-    share_info->fan_rpms = 0;
-    share_info->auto_duty = 1;
-    share_info->auto_duty_val = 0;
-    share_info->manual_next_fan_duty = 0;
-    share_info->manual_prev_fan_duty = 0;
+    share_info->magic = SHARE_MAGIC;
+    share_info->version = SHARE_VERSION;
+    share_info->size = sizeof(*share_info);
+    share_info->history_size = EC_HISTORY_SIZE;
+    snprintf(share_info->profile, sizeof(share_info->profile), "%s",
+            ec_profile->name);
+    for (int i = 0; i < ec_profile->sensor_count; i++)
+        strncpy(share_info->sensor_names[i], ec_profile->sensors[i].name,
+                EC_NAME_SIZE - 1);
+    for (int i = 0; i < ec_profile->fan_count; i++)
+        strncpy(share_info->fan_names[i], ec_profile->fans[i].name,
+                EC_NAME_SIZE - 1);
+    atomic_init(&share_info->exit, 0);
+    atomic_init(&share_info->sample_seq, 0);
+    atomic_init(&share_info->command_head, 0);
+    atomic_init(&share_info->command_tail, 0);
+    atomic_init(&share_info->history_head, 0);
+    for (int i = 0; i < EC_HISTORY_SIZE; i++)
+        atomic_init(&share_info->history[i].seq, 0);
+    memset(&share_info->stats, 0, sizeof(share_info->stats));
+    struct ec_sample sample = { .sensor_count = ec_profile->sensor_count,
+            .fan_count = ec_profile->fan_count, .auto_duty = 1, .cpu_load = -1,
+            .gpu_load = -1, .package_power_mw = -1, .control = config.control };
+    share_publish_sample(&sample);
+    worker_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ui_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (worker_event_fd < 0 || ui_event_fd < 0) {
+        printf("unable to create worker event: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 }
 
 static int main_ec_worker(void) {
     setuid(0);
-    system("modprobe ec_sys");
+    printf("EC profile %s: %d sensors, %d fans\n", ec_profile->name,
+            ec_profile->sensor_count, ec_profile->fan_count);
+    if (ec_sysfs_prepare() != EXIT_SUCCESS)
+        printf("unable to read EC from sysfs, polling EC ports: %s\n",
+                strerror(errno));
+    if (socket_open() != EXIT_SUCCESS)
+        printf("unable to open control socket %s: %s\n", SOCKET_PATH,
+                strerror(errno));
+    if (strlen(config.trace_file) > 0
+            && trace_open(config.trace_file) != EXIT_SUCCESS)
+        printf("unable to record trace %s: %s\n", config.trace_file,
+                strerror(errno));
+    if (strlen(config.metrics_listen) > 0
+            && metrics_open(config.metrics_listen) != EXIT_SUCCESS)
+        printf("unable to listen for metrics on %s: %s\n",
+                config.metrics_listen, strerror(errno));
+    load_open();
+    if (config.temp_source != TEMP_SOURCE_EC)
+        hwmon_open();
+    power_open();
+    worker_realtime();
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        printf("unable to create worker timer: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct worker_state state = { .interval_ms = WORKER_INTERVAL_MIN_MS,
+            .prev_temp = -1 };
+    share_read_sample(&state.sample);
+    state.published = state.sample;
+    state.ec_raw = state.sample;
+    int timer_expired = 1;
+    uint64_t deadline_ns = get_monotonic_ns();
+    uint64_t settle_ns = 0;
     while (share_info->exit == 0) {
         // check parent
         if (parent_pid != 0 && kill(parent_pid, 0) == -1) {
             printf("worker on parent death\n");
             break;
         }
-        // write EC
-        int new_fan_duty = share_info->manual_next_fan_duty;
-        if (new_fan_duty != 0
-                && new_fan_duty != share_info->manual_prev_fan_duty) {
-            ec_write_fan_duty(new_fan_duty);
-            share_info->manual_prev_fan_duty = new_fan_duty;
-        }
-        // read EC
-        int io_fd = open("/sys/kernel/debug/ec/ec0/io", O_RDONLY, 0);
-        if (io_fd < 0) {
-            printf("unable to read EC from sysfs: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-        unsigned char buf[EC_REG_SIZE];
-        ssize_t len = read(io_fd, buf, EC_REG_SIZE);
-        switch (len) {
-        case -1:
-            printf("unable to read EC from sysfs: %s\n", strerror(errno));
-            break;
-        case 0x100:
-            share_info->cpu_temp = buf[EC_REG_CPU_TEMP];
-            share_info->gpu_temp = buf[EC_REG_GPU_TEMP];
-            share_info->fan_duty = calculate_fan_duty(buf[EC_REG_FAN_DUTY]);
-            share_info->fan_rpms = calculate_fan_rpms(buf[EC_REG_FAN_RPMS_HI],
-                    buf[EC_REG_FAN_RPMS_LO]);
-            /*
-             printf("temp=%d, duty=%d, rpms=%d\n", share_info->cpu_temp,
-             share_info->fan_duty, share_info->fan_rpms);
-             */
-            break;
-        default:
-            printf("wrong EC size from sysfs: %ld\n", len);
-        }
-        close(io_fd);
-        // auto EC
-        if (share_info->auto_duty == 1) {
-            int next_duty = ec_auto_duty_adjust();
-            if (next_duty != 0 && next_duty != share_info->auto_duty_val) {
+        // read commands
+        struct ec_command command;
+        while (share_pop_command(&command))
+            main_ec_worker_command(&state.sample, &command);
+        // after resume reopen ec_sys, hold control until the EC settles and
+        // then re-apply the duty, the EC may have reset it
+        uint64_t slept_ns = power_resumed();
+        if (slept_ns != 0) {
+            printf("resumed after %.1fs, re-validating EC\n", slept_ns / 1e9);
+            if (ec_sysfs_open() != EXIT_SUCCESS)
+                printf("unable to read EC from sysfs, polling EC ports: %s\n",
+                        strerror(errno));
+            control_reset();
+            for (int i = 0; i < ec_profile->fan_count; i++) {
+                int duty = state.sample.auto_duty ?
+                        state.sample.auto_duty_val[i] :
+                        state.sample.manual_duty;
+                fan_writers[i].last_write_ns = 0;
+                fan_writers[i].verify_duty = 0;
+                if (duty != 0)
+                    fan_writer_request(&fan_writers[i], duty);
+            }
+            state.decoded = 0;
+            state.prev_temp = -1;
+            filter_reset();
+            settle_ns = get_monotonic_ns() + RESUME_SETTLE_NS;
+        }
+        state.settling = settle_ns != 0 && get_monotonic_ns() < settle_ns;
+        uint64_t write_deadline_ns = worker_tick(&ec_backend_hw, &state);
+        // schedule next sample by the interval of the tick
+        uint64_t now_ns = get_monotonic_ns();
+        uint64_t interval_ns = state.interval_ms * 1000000ULL;
+        if (timer_expired)
+            deadline_ns += interval_ns;
+        if (deadline_ns <= now_ns || deadline_ns > now_ns + interval_ns)
+            deadline_ns = now_ns + interval_ns;
+        if (write_deadline_ns != 0 && write_deadline_ns < deadline_ns)
+            deadline_ns = write_deadline_ns;
+        timer_expired = main_ec_worker_wait(timer_fd, deadline_ns,
+                &state.sample);
+        if (timer_expired)
+            stats_record(EC_STATS_JITTER,
+                    MAX(get_monotonic_ns(), deadline_ns) - deadline_ns);
+    }
+    socket_close();
+    metrics_close();
+    trace_close();
+    load_close();
+    hwmon_close();
+    power_close();
+    shm_unlink(SHARE_NAME);
+    close(timer_fd);
+    if (ec_sysfs_fd >= 0)
+        close(ec_sysfs_fd);
+    ec_io_print_stats();
+    for (int i = 0; i < ec_profile->fan_count; i++)
+        printf("%s fan writes issued=%lu suppressed=%lu coalesced=%lu "
+                "failed=%lu unverified=%lu\n", ec_profile->fans[i].name,
+                (unsigned long) fan_writers[i].issued,
+                (unsigned long) fan_writers[i].suppressed,
+                (unsigned long) fan_writers[i].coalesced,
+                (unsigned long) fan_writers[i].failed,
+                (unsigned long) fan_writers[i].unverified);
+    printf("worker quit\n");
+    return EXIT_SUCCESS;
+}
+
+/* one sample of the worker: reads the EC, fuses, filters and controls the
+ * fans, writes their duty and publishes the sample; schedules the next one
+ * in state->interval_ms and returns when a held back fan write is due, or
+ * 0. Times come from the clock of the backend. */
+static uint64_t worker_tick(const struct ec_backend* backend,
+        struct worker_state* state) {
+    struct ec_sample* sample = &state->sample;
+    struct ec_sample* ec_raw = &state->ec_raw;
+    // read EC
+    uint8_t buf[EC_REG_SIZE];
+    int raw_duties[EC_MAX_FANS];
+    for (int i = 0; i < EC_MAX_FANS; i++)
+        raw_duties[i] = -1;
+    uint64_t phase_ns = backend->clock();
+    int read_result = backend->read_registers(buf);
+    uint64_t read_ns = backend->clock() - phase_ns;
+    histogram_record(&ec_read_histogram, read_ns);
+    stats_record(EC_STATS_READ, read_ns);
+    phase_ns += read_ns;
+    if (read_result != EXIT_SUCCESS) {
+        if (!state->quiet)
+            printf("unable to read EC: %s\n", strerror(errno));
+    } else if (ec_registers_valid(buf, state->quiet) != EXIT_SUCCESS) {
+        // keep the previous sample, the next read is compared to it
+        ec_io_errors.rejected++;
+    } else {
+        // most ticks read the same registers, decode only on change
+        if (ec_registers_changed(buf, state->prev_buf) || !state->decoded)
+            ec_decode_sample(buf, ec_raw);
+        state->decoded = 1;
+        for (int i = 0; i < ec_profile->fan_count; i++)
+            raw_duties[i] = buf[ec_profile->fans[i].duty_reg];
+    }
+    // temps and RPMs are filtered from the raw readings every tick
+    memcpy(sample->fan_duty, ec_raw->fan_duty, sizeof(sample->fan_duty));
+    hwmon_fuse(sample, ec_raw->temps);
+    filter_apply(sample, ec_raw->fan_rpms, backend->clock());
+    backend->read_loads(sample, backend->clock());
+    stats_phase_end(EC_STATS_DECODE, &phase_ns, backend->clock());
+    // auto EC
+    for (int i = 0; i < ec_profile->fan_count && sample->auto_duty == 1
+            && !state->settling; i++) {
+        int next_duty = ec_auto_duty_adjust(sample, i, backend->clock());
+        if (next_duty != 0 && next_duty != sample->auto_duty_val[i]) {
+            if (!state->quiet) {
                 char s_time[256];
                 get_time_string(s_time, 256, "%m/%d %H:%M:%S");
-                printf("%s CPU=%d°C, GPU=%d°C, auto fan duty to %d%%\n", s_time,
-                        share_info->cpu_temp, share_info->gpu_temp, next_duty);
-                ec_write_fan_duty(next_duty);
-                share_info->auto_duty_val = next_duty;
+                printf("%s %s=%d°C, auto fan duty to %d%%\n", s_time,
+                        ec_profile->fans[i].name, sample_fan_temp(sample, i),
+                        next_duty);
             }
+            fan_writer_request(&fan_writers[i], next_duty);
+            sample->auto_duty_val[i] = next_duty;
         }
-        //
-        usleep(200 * 1000);
     }
-    printf("worker quit\n");
+    stats_phase_end(EC_STATS_CONTROL, &phase_ns, backend->clock());
+    // write EC
+    uint64_t write_deadline_ns = 0;
+    for (int i = 0; i < ec_profile->fan_count && !state->settling; i++) {
+        uint64_t issued = fan_writers[i].issued;
+        uint64_t retry_ns = fan_writer_flush(backend, &fan_writers[i], i,
+                raw_duties[i], backend->clock(), state->quiet);
+        if (fan_writers[i].issued != issued)
+            state->prev_temp = -1;
+        if (retry_ns != 0
+                && (write_deadline_ns == 0 || retry_ns < write_deadline_ns))
+            write_deadline_ns = retry_ns;
+    }
+    stats_phase_end(EC_STATS_WRITE, &phase_ns, backend->clock());
+    if (memcmp(sample, &state->published, sizeof(*sample)) != 0) {
+        share_publish_sample(sample);
+        main_notify_ui(sample, &state->published);
+        state->published = *sample;
+    }
+    share_append_history(sample, backend->clock());
+    if (metrics_fd >= 0 || strlen(config.metrics_textfile) > 0)
+        metrics_render(sample, backend->clock());
+    if (trace_fd >= 0)
+        trace_append(sample, backend->clock());
+    stats_phase_end(EC_STATS_PUBLISH, &phase_ns, backend->clock());
+    stats_update_counters();
+    // fast while ramping or right after a write, slower on battery
+    int temp = sample_max_temp(sample);
+    state->interval_ms = worker_interval(state->interval_ms,
+            state->prev_temp < 0
+                    || abs(temp - state->prev_temp) >= WORKER_RAMP_DELTA
+                    || state->settling);
+    state->prev_temp = temp;
+    return write_deadline_ns;
+}
+
+/* sleeps until the deadline, a notification from the UI or a command from a
+ * socket client while answering socket queries, returns 1 when woken up by
+ * the timer */
+static int main_ec_worker_wait(int timer_fd, uint64_t deadline_ns,
+        struct ec_sample* sample) {
+    struct itimerspec spec = { { 0, 0 }, { deadline_ns / 1000000000ULL,
+            deadline_ns % 1000000000ULL } };
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0) {
+        printf("unable to arm worker timer: %s\n", strerror(errno));
+        usleep(WORKER_INTERVAL_MIN_MS * 1000);
+        return 1;
+    }
+    for (;;) {
+        struct pollfd fds[5 + SOCKET_MAX_CLIENTS + METRICS_MAX_CLIENTS] = {
+                { timer_fd, POLLIN, 0 },
+                { worker_event_fd, POLLIN, 0 },
+                { socket_fd, POLLIN, 0 },
+                { metrics_fd, POLLIN, 0 },
+                { power.uevent_fd, POLLIN, 0 } };
+        struct pollfd* socket_fds = fds + 5;
+        struct pollfd* metrics_fds = socket_fds + SOCKET_MAX_CLIENTS;
+        for (int i = 0; i < SOCKET_MAX_CLIENTS; i++)
+            socket_fds[i] = (struct pollfd ) { socket_clients[i].fd, POLLIN, 0 };
+        for (int i = 0; i < METRICS_MAX_CLIENTS; i++)
+            metrics_fds[i] = (struct pollfd ) { metrics_clients[i].fd, POLLIN,
+                            0 };
+        if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0)
+            return 0;
+        uint64_t count;
+        int woken = 0;
+        if (fds[1].revents & POLLIN) {
+            read(worker_event_fd, &count, sizeof(count));
+            woken = 1;
+        }
+        for (int i = 0; i < SOCKET_MAX_CLIENTS; i++) {
+            if (socket_fds[i].revents != 0)
+                woken |= socket_client_read(&socket_clients[i], sample);
+        }
+        for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+            if (metrics_fds[i].revents != 0)
+                metrics_client_read(&metrics_clients[i]);
+        }
+        if (fds[2].revents & POLLIN)
+            socket_accept();
+        if (fds[3].revents & POLLIN)
+            metrics_accept();
+        if (fds[4].revents & POLLIN) {
+            int on_battery = power.on_battery;
+            power_read_uevents();
+            woken |= power.on_battery != on_battery;
+        }
+        if (fds[0].revents & POLLIN) {
+            read(timer_fd, &count, sizeof(count));
+            return 1;
+        }
+        if (woken)
+            return 0;
+    }
+}
+
+/* applies a command from the UI or a socket client, returns EXIT_FAILURE if
+ * it is invalid */
+static int main_ec_worker_command(struct ec_sample* sample,
+        const struct ec_command* command) {
+    if (command->type == EC_COMMAND_AUTO) {
+        control_reset();
+        sample->auto_duty = 1;
+        sample->manual_duty = 0;
+    } else if (command->type == EC_COMMAND_MANUAL
+            && command->value >= MIN_FAN_DUTY
+            && command->value <= MAX_FAN_DUTY) {
+        sample->auto_duty = 0;
+        sample->manual_duty = command->value;
+        for (int i = 0; i < ec_profile->fan_count; i++)
+            fan_writer_request(&fan_writers[i], command->value);
+    } else if (command->type == EC_COMMAND_CONTROL
+            && (command->value == CONTROL_CURVE
+                    || command->value == CONTROL_PID)) {
+        // the mode is kept, auto mode continues with the other controller
+        control_reset();
+        config.control = command->value;
+        sample->control = command->value;
+    } else {
+        return EXIT_FAILURE;
+    }
+    memset(sample->auto_duty_val, 0, sizeof(sample->auto_duty_val));
     return EXIT_SUCCESS;
 }
 
+static void main_notify_worker(void) {
+    uint64_t one = 1;
+    if (worker_event_fd >= 0)
+        write(worker_event_fd, &one, sizeof(one));
+}
+
+/* only the fields shown by the indicator wake it up */
+static void main_notify_ui(const struct ec_sample* sample,
+        const struct ec_sample* prev_sample) {
+    uint64_t one = 1;
+    if (parent_pid == 0 || ui_event_fd < 0)
+        return;
+    if (memcmp(sample->temps, prev_sample->temps, sizeof(sample->temps)) != 0
+            || memcmp(sample->fan_rpms, prev_sample->fan_rpms,
+                    sizeof(sample->fan_rpms)) != 0
+            || memcmp(sample->fan_duty, prev_sample->fan_duty,
+                    sizeof(sample->fan_duty)) != 0
+            || sample->auto_duty != prev_sample->auto_duty
+            || sample->manual_duty != prev_sample->manual_duty
+            || sample->control != prev_sample->control)
+        write(ui_event_fd, &one, sizeof(one));
+}
+
 static void main_ui_worker(int argc, char** argv) {
     printf("Indicator...\n");
     int desktop_uid = getuid();
@@ -324,13 +1423,24 @@ static void main_ui_worker(int argc, char** argv) {
     GtkWidget* indicator_menu = gtk_menu_new();
     for (int i = 0; i < menuitem_count; i++) {
         GtkWidget* item;
+        if (menuitems[i].type == FANS) {
+            // fan readings are only shown, the label is set by ui_update()
+            for (int j = 0; j < ec_profile->fan_count; j++) {
+                ui_fan_items[j] = gtk_menu_item_new_with_label("-");
+                gtk_widget_set_sensitive(ui_fan_items[j], FALSE);
+                gtk_menu_shell_append(GTK_MENU_SHELL(indicator_menu),
+                        ui_fan_items[j]);
+            }
+            continue;
+        }
         if (strlen(menuitems[i].label) == 0) {
             item = gtk_separator_menu_item_new();
         } else {
             item = gtk_menu_item_new_with_label(menuitems[i].label);
-            g_signal_connect_swapped(item, "activate",
-                    G_CALLBACK(menuitems[i].callback),
-                    (void* ) menuitems[i].option);
+            if (menuitems[i].callback != NULL)
+                g_signal_connect_swapped(item, "activate",
+                        G_CALLBACK(menuitems[i].callback),
+                        (void* ) menuitems[i].option);
         }
         gtk_menu_shell_append(GTK_MENU_SHELL(indicator_menu), item);
         menuitems[i].widget = item;
@@ -345,8 +1455,12 @@ static void main_ui_worker(int argc, char** argv) {
     app_indicator_set_ordering_index(indicator, -2);
     app_indicator_set_title(indicator, "Clevo");
     app_indicator_set_menu(indicator, GTK_MENU(indicator_menu));
-    g_timeout_add(500, &ui_update, NULL);
-    ui_toggle_menuitems(share_info->fan_duty);
+    g_unix_fd_add(ui_event_fd, G_IO_IN, &ui_on_event, NULL);
+    struct ec_sample sample;
+    share_read_sample(&sample);
+    ui_toggle_menuitems(sample.auto_duty ? 0 : sample.manual_duty,
+            sample.control);
+    ui_update(NULL);
     gtk_main();
     printf("main on UI quit\n");
 }
@@ -360,241 +1474,3249 @@ static void main_on_sigterm(int signum) {
     printf("main on signal: %s\n", strsignal(signum));
     if (share_info != NULL)
         share_info->exit = 1;
+    main_notify_worker();
     exit(EXIT_SUCCESS);
 }
 
-static int main_dump_fan(void) {
-    printf("Dump fan information\n");
-    printf("  FAN Duty: %d%%\n", ec_query_fan_duty());
-    printf("  FAN RPMs: %d RPM\n", ec_query_fan_rpms());
-    printf("  CPU Temp: %d°C\n", ec_query_cpu_temp());
-    printf("  GPU Temp: %d°C\n", ec_query_gpu_temp());
-    return EXIT_SUCCESS;
+static void share_publish_sample(const struct ec_sample* sample) {
+    unsigned seq = atomic_load_explicit(&share_info->sample_seq,
+            memory_order_relaxed);
+    atomic_store_explicit(&share_info->sample_seq, seq + 1,
+            memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    share_info->sample = *sample;
+    atomic_store_explicit(&share_info->sample_seq, seq + 2,
+            memory_order_release);
 }
 
-static int main_test_fan(int duty_percentage) {
-    printf("Change fan duty to %d%%\n", duty_percentage);
-    ec_write_fan_duty(duty_percentage);
-    printf("\n");
-    main_dump_fan();
-    return EXIT_SUCCESS;
+/* returns the version of the sample read, retrying while being written */
+static unsigned share_read_sample(struct ec_sample* sample) {
+    unsigned seq_begin, seq_end;
+    do {
+        seq_begin = atomic_load_explicit(&share_info->sample_seq,
+                memory_order_acquire);
+        *sample = share_info->sample;
+        atomic_thread_fence(memory_order_acquire);
+        seq_end = atomic_load_explicit(&share_info->sample_seq,
+                memory_order_relaxed);
+    } while ((seq_begin & 1) != 0 || seq_begin != seq_end);
+    return seq_begin / 2;
 }
 
-static gboolean ui_update(gpointer user_data) {
-    char label[256];
-    sprintf(label, "%d℃ %d℃", share_info->cpu_temp, share_info->gpu_temp);
-    app_indicator_set_label(indicator, label, "XXXXXX");
-    char icon_name[256];
-    double load = ((double) share_info->fan_rpms) / MAX_FAN_RPM * 100.0;
-    double load_r = round(load / 5.0) * 5.0;
-    sprintf(icon_name, "brasero-disc-%02d", (int) load_r);
-    app_indicator_set_icon(indicator, icon_name);
-    return G_SOURCE_CONTINUE;
+static unsigned share_sample_version(void) {
+    return atomic_load_explicit(&share_info->sample_seq, memory_order_acquire)
+            / 2;
 }
 
-static void ui_command_set_fan(long fan_duty) {
-    int fan_duty_val = (int) fan_duty;
-    if (fan_duty_val == 0) {
-        printf("clicked on fan duty auto\n");
-        share_info->auto_duty = 1;
-        share_info->auto_duty_val = 0;
-        share_info->manual_next_fan_duty = 0;
-    } else {
-        printf("clicked on fan duty: %d\n", fan_duty_val);
-        share_info->auto_duty = 0;
-        share_info->auto_duty_val = 0;
-        share_info->manual_next_fan_duty = fan_duty_val;
+static int share_push_command(int type, int value) {
+    unsigned head = atomic_load_explicit(&share_info->command_head,
+            memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&share_info->command_tail,
+            memory_order_acquire);
+    if (head - tail >= EC_COMMAND_RING_SIZE) {
+        printf("command queue full, dropped command %d\n", type);
+        return EXIT_FAILURE;
     }
-    ui_toggle_menuitems(fan_duty_val);
+    struct ec_command* command = &share_info->commands[head
+            % EC_COMMAND_RING_SIZE];
+    command->type = type;
+    command->value = value;
+    atomic_store_explicit(&share_info->command_head, head + 1,
+            memory_order_release);
+    return EXIT_SUCCESS;
 }
 
-static void ui_command_quit(gchar* command) {
-    printf("clicked on quit\n");
-    gtk_main_quit();
+/* returns 1 if a command was dequeued */
+static int share_pop_command(struct ec_command* command) {
+    unsigned tail = atomic_load_explicit(&share_info->command_tail,
+            memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&share_info->command_head,
+            memory_order_acquire);
+    if (tail == head)
+        return 0;
+    *command = share_info->commands[tail % EC_COMMAND_RING_SIZE];
+    atomic_store_explicit(&share_info->command_tail, tail + 1,
+            memory_order_release);
+    return 1;
 }
 
-static void ui_toggle_menuitems(int fan_duty) {
-    for (int i = 0; i < menuitem_count; i++) {
-        if (menuitems[i].widget == NULL)
-            continue;
-        if (fan_duty == 0)
-            gtk_widget_set_sensitive(menuitems[i].widget,
-                    menuitems[i].type != AUTO);
-        else
-            gtk_widget_set_sensitive(menuitems[i].widget,
-                    menuitems[i].type != MANUAL
-                            || (int) menuitems[i].option != fan_duty);
+static void share_append_history(const struct ec_sample* sample,
+        uint64_t timestamp_ns) {
+    unsigned index = atomic_load_explicit(&share_info->history_head,
+            memory_order_relaxed);
+    struct ec_history_slot* slot = &share_info->history[index
+            % EC_HISTORY_SIZE];
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->record.timestamp_ns = timestamp_ns;
+    for (int i = 0; i < EC_MAX_SENSORS; i++)
+        slot->record.temps[i] = sample->temps[i];
+    for (int i = 0; i < EC_MAX_FANS; i++) {
+        slot->record.fan_rpms[i] = sample->fan_rpms[i];
+        slot->record.fan_duty[i] = sample->fan_duty[i];
     }
+    slot->record.auto_duty = sample->auto_duty;
+    atomic_store_explicit(&slot->seq, index + 1, memory_order_release);
+    atomic_store_explicit(&share_info->history_head, index + 1,
+            memory_order_release);
 }
 
-static int ec_init(void) {
-    if (ioperm(EC_DATA, 1, 1) != 0)
+/* maps the shared memory of the running instance into share_info */
+static int share_map_readonly(void) {
+    int shm_fd = shm_open(SHARE_NAME, O_RDONLY | O_CLOEXEC, 0);
+    struct stat st;
+    if (shm_fd < 0 || fstat(shm_fd, &st) != 0
+            || st.st_size < (off_t) sizeof(*share_info)) {
+        printf("unable to open shared memory: %s\n", strerror(errno));
+        if (shm_fd >= 0)
+            close(shm_fd);
         return EXIT_FAILURE;
-    if (ioperm(EC_SC, 1, 1) != 0)
+    }
+    void* shm = mmap(NULL, sizeof(*share_info), PROT_READ, MAP_SHARED, shm_fd,
+            0);
+    close(shm_fd);
+    if (shm == MAP_FAILED) {
+        printf("unable to map shared memory: %s\n", strerror(errno));
         return EXIT_FAILURE;
+    }
+    share_info = shm;
+    if (share_info->magic != SHARE_MAGIC
+            || share_info->version != SHARE_VERSION) {
+        printf("unsupported shared memory version %u\n", share_info->version);
+        munmap(shm, sizeof(*share_info));
+        share_info = NULL;
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }
 
-static void ec_on_sigterm(int signum) {
-    printf("ec on signal: %s\n", strsignal(signum));
-    if (share_info != NULL)
-        share_info->exit = 1;
-}
-
-static int ec_auto_duty_adjust(void) {
-    int temp = MAX(share_info->cpu_temp, share_info->gpu_temp);
-    int duty = share_info->fan_duty;
-    //
-    if (temp >= 80 && duty < 100)
-        return 100;
-    if (temp >= 70 && duty < 90)
-        return 90;
-    if (temp >= 60 && duty < 80)
-        return 80;
-    if (temp >= 50 && duty < 70)
-        return 70;
-    if (temp >= 40 && duty < 60)
-        return 60;
-    if (temp >= 30 && duty < 50)
-        return 50;
-    if (temp >= 20 && duty < 40)
-        return 40;
-    if (temp >= 10 && duty < 30)
-        return 30;
-    //
-    if (temp <= 15 && duty > 30)
-        return 30;
-    if (temp <= 25 && duty > 40)
-        return 40;
-    if (temp <= 35 && duty > 50)
-        return 50;
-    if (temp <= 45 && duty > 60)
-        return 60;
-    if (temp <= 55 && duty > 70)
-        return 70;
-    if (temp <= 65 && duty > 80)
-        return 80;
-    if (temp <= 75 && duty > 90)
-        return 90;
-    //
-    return 0;
-}
-
-static int ec_query_cpu_temp(void) {
-    return ec_io_read(EC_REG_CPU_TEMP);
-}
-
-static int ec_query_gpu_temp(void) {
-    return ec_io_read(EC_REG_GPU_TEMP);
+/* copies records appended since the given history index, at most the latest
+ * max of them in chronological order; stores the index to continue from */
+static int share_read_history(unsigned since,
+        struct ec_history_record* records, int max, unsigned* next) {
+    unsigned head = atomic_load_explicit(&share_info->history_head,
+            memory_order_acquire);
+    unsigned first = since;
+    if (head - first > (unsigned) max)
+        first = head - max;
+    if (head - first > EC_HISTORY_SIZE)
+        first = head - EC_HISTORY_SIZE;
+    int count = 0;
+    for (unsigned index = first; index != head; index++) {
+        struct ec_history_slot* slot = &share_info->history[index
+                % EC_HISTORY_SIZE];
+        unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != index + 1)
+            continue;
+        records[count] = slot->record;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq)
+            count++;
+    }
+    if (next != NULL)
+        *next = head;
+    return count;
 }
 
-static int ec_query_fan_duty(void) {
-    int raw_duty = ec_io_read(EC_REG_FAN_DUTY);
-    return calculate_fan_duty(raw_duty);
+static int main_dump_fan(void) {
+    printf("Dump fan information\n");
+    struct ec_sample sample;
+    if (ec_query_sample(&sample) != EXIT_SUCCESS) {
+        printf("unable to read EC: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    const char* sensor_names[EC_MAX_SENSORS];
+    const char* fan_names[EC_MAX_FANS];
+    for (int i = 0; i < ec_profile->sensor_count; i++)
+        sensor_names[i] = ec_profile->sensors[i].name;
+    for (int i = 0; i < ec_profile->fan_count; i++)
+        fan_names[i] = ec_profile->fans[i].name;
+    main_print_sample(&sample, sensor_names, fan_names);
+    return EXIT_SUCCESS;
 }
 
-static int ec_query_fan_rpms(void) {
-    int raw_rpm_hi = ec_io_read(EC_REG_FAN_RPMS_HI);
-    int raw_rpm_lo = ec_io_read(EC_REG_FAN_RPMS_LO);
-    return calculate_fan_rpms(raw_rpm_hi, raw_rpm_lo);
+/* prints the latest sample of the running instance from the shared memory,
+ * without any EC access */
+static int main_dump_share(void) {
+    printf("Dump fan information of the running instance\n");
+    if (share_map_readonly() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    void* shm = share_info;
+    struct ec_sample sample;
+    share_read_sample(&sample);
+    char names[EC_MAX_SENSORS + EC_MAX_FANS][EC_NAME_SIZE];
+    const char* sensor_names[EC_MAX_SENSORS];
+    const char* fan_names[EC_MAX_FANS];
+    for (int i = 0; i < EC_MAX_SENSORS; i++) {
+        memcpy(names[i], share_info->sensor_names[i], EC_NAME_SIZE);
+        names[i][EC_NAME_SIZE - 1] = '\0';
+        sensor_names[i] = names[i];
+    }
+    for (int i = 0; i < EC_MAX_FANS; i++) {
+        memcpy(names[EC_MAX_SENSORS + i], share_info->fan_names[i],
+                EC_NAME_SIZE);
+        names[EC_MAX_SENSORS + i][EC_NAME_SIZE - 1] = '\0';
+        fan_names[i] = names[EC_MAX_SENSORS + i];
+    }
+    munmap(shm, sizeof(*share_info));
+    share_info = NULL;
+    main_print_sample(&sample, sensor_names, fan_names);
+    if (sample.auto_duty)
+        printf("  FAN Mode: auto\n");
+    else
+        printf("  FAN Mode: manual %d%%\n", sample.manual_duty);
+    return EXIT_SUCCESS;
 }
 
-static int ec_write_fan_duty(int duty_percentage) {
-    if (duty_percentage < 60 || duty_percentage > 100) {
-        printf("Wrong fan duty to write: %d\n", duty_percentage);
+/* the worker statistics from the shared memory, without touching the EC */
+static int main_stats(void) {
+    if (share_map_readonly() != EXIT_SUCCESS)
         return EXIT_FAILURE;
+    const struct ec_stats* stats = &share_info->stats;
+    printf("Worker statistics of the running instance, %llu ticks\n",
+            atomic_load_explicit(&stats->ticks, memory_order_relaxed));
+    printf("  %-8s %10s %10s %10s %10s %10s\n", "phase", "count", "mean_us",
+            "p50_us", "p99_us", "max_us");
+    for (int i = 0; i < EC_STATS_PHASES; i++) {
+        const struct ec_stats_histogram* histogram = &stats->phases[i];
+        unsigned long long count = atomic_load_explicit(&histogram->count,
+                memory_order_relaxed);
+        unsigned long long sum_ns = atomic_load_explicit(&histogram->sum_ns,
+                memory_order_relaxed);
+        unsigned long long max_ns = atomic_load_explicit(&histogram->max_ns,
+                memory_order_relaxed);
+        printf("  %-8s %10llu %10.1f %10llu %10llu %10.1f\n",
+                stats_phase_names[i], count,
+                count > 0 ? sum_ns / 1000.0 / count : 0.0,
+                (unsigned long long) stats_percentile_us(histogram, 0.5),
+                (unsigned long long) stats_percentile_us(histogram, 0.99),
+                max_ns / 1000.0);
     }
-    double v_d = ((double) duty_percentage) / 100.0 * 255.0;
-    int v_i = (int) v_d;
-    return ec_io_do(0x99, 0x01, v_i);
+    printf("  percentiles are bucket upper bounds, within 25%%\n");
+    for (int i = 0; i < EC_STATS_IO_PHASES; i++)
+        printf("  EC %-4s waits=%llu timeouts=%llu\n", ec_io_phase_names[i],
+                atomic_load_explicit(&stats->io_waits[i], memory_order_relaxed),
+                atomic_load_explicit(&stats->io_timeouts[i],
+                        memory_order_relaxed));
+    for (int i = 0; i < EC_MAX_FANS && share_info->fan_names[i][0] != '\0';
+            i++)
+        printf("  %.*s fan writes issued=%llu suppressed=%llu coalesced=%llu "
+                "failed=%llu unverified=%llu\n", EC_NAME_SIZE,
+                share_info->fan_names[i],
+                atomic_load_explicit(&stats->fan_writes_issued[i],
+                        memory_order_relaxed),
+                atomic_load_explicit(&stats->fan_writes_suppressed[i],
+                        memory_order_relaxed),
+                atomic_load_explicit(&stats->fan_writes_coalesced[i],
+                        memory_order_relaxed),
+                atomic_load_explicit(&stats->fan_writes_failed[i],
+                        memory_order_relaxed),
+                atomic_load_explicit(&stats->fan_writes_unverified[i],
+                        memory_order_relaxed));
+    printf("  EC retries=%llu failures=%llu rejected samples=%llu\n",
+            atomic_load_explicit(&stats->io_retries, memory_order_relaxed),
+            atomic_load_explicit(&stats->io_failures, memory_order_relaxed),
+            atomic_load_explicit(&stats->samples_rejected,
+                    memory_order_relaxed));
+    munmap(share_info, sizeof(*share_info));
+    share_info = NULL;
+    return EXIT_SUCCESS;
 }
 
-static int ec_io_wait(const uint32_t port, const uint32_t flag,
-        const char value) {
-    uint8_t data = inb(port);
-    int i = 0;
-    while ((((data >> flag) & 0x1) != value) && (i++ < 100)) {
-        usleep(1000);
-        data = inb(port);
+/* a single fan keeps the original "FAN Duty" lines */
+static void main_print_sample(const struct ec_sample* sample,
+        const char* const * sensor_names, const char* const * fan_names) {
+    int fan_count = MIN(sample->fan_count, EC_MAX_FANS);
+    int sensor_count = MIN(sample->sensor_count, EC_MAX_SENSORS);
+    for (int i = 0; i < fan_count; i++) {
+        char fan[EC_NAME_SIZE + 8] = "FAN";
+        if (fan_count > 1)
+            snprintf(fan, sizeof(fan), "FAN %s", fan_names[i]);
+        printf("  %s Duty: %d%%\n", fan, sample->fan_duty[i]);
+        printf("  %s RPMs: %d RPM\n", fan, sample->fan_rpms[i]);
     }
-    if (i >= 100) {
-        printf("wait_ec error on port 0x%x, data=0x%x, flag=0x%x, value=0x%x\n",
-                port, data, flag, value);
-        return EXIT_FAILURE;
+    for (int i = 0; i < sensor_count; i++) {
+        char sensor[EC_NAME_SIZE] = "";
+        for (int j = 0; j < EC_NAME_SIZE - 1 && sensor_names[i][j] != '\0';
+                j++)
+            sensor[j] = toupper((unsigned char) sensor_names[i][j]);
+        printf("  %s Temp: %d°C\n", sensor, sample->temps[i]);
     }
-    return EXIT_SUCCESS;
 }
 
-static uint8_t ec_io_read(const uint32_t port) {
-    ec_io_wait(EC_SC, IBF, 0);
-    outb(EC_SC_READ_CMD, EC_SC);
+static int main_test_fan(int duty_percentage) {
+    printf("Change fan duty to %d%%\n", duty_percentage);
+    for (int i = 0; i < ec_profile->fan_count; i++) {
+        if (ec_write_fan_duty(&ec_backend_hw, i, duty_percentage)
+                != EXIT_SUCCESS)
+            printf("unable to write %s fan duty: %s\n",
+                    ec_profile->fans[i].name, strerror(errno));
+    }
+    printf("\n");
+    main_dump_fan();
+    printf("\n");
+    ec_io_print_stats();
+    return EXIT_SUCCESS;
+}
 
-    ec_io_wait(EC_SC, IBF, 0);
-    outb(port, EC_DATA);
+/* reads the decoded registers by every access path and reports latencies
+ * with the EC handshakes that had to sleep or timed out */
+static int main_bench(int iterations) {
+    printf("Benchmark EC access, %d iterations\n", iterations);
+    uint64_t* samples = calloc(iterations, sizeof(uint64_t));
+    if (samples == NULL)
+        return EXIT_FAILURE;
+    uint8_t buf[EC_REG_SIZE];
+    if (ec_sysfs_prepare() == EXIT_SUCCESS) {
+        for (int i = 0; i < iterations; i++) {
+            uint64_t begin_ns = get_monotonic_ns();
+            ec_sysfs_read(buf);
+            samples[i] = get_monotonic_ns() - begin_ns;
+        }
+        main_bench_report("sysfs pread", samples, iterations);
+        close(ec_sysfs_fd);
+        ec_sysfs_fd = -1;
+        for (int i = 0; i < iterations; i++) {
+            uint64_t begin_ns = get_monotonic_ns();
+            int io_fd = open(EC_SYSFS_IO, O_RDONLY, 0);
+            if (io_fd >= 0) {
+                read(io_fd, buf, EC_REG_SIZE);
+                close(io_fd);
+            }
+            samples[i] = get_monotonic_ns() - begin_ns;
+        }
+        main_bench_report("sysfs reopen", samples, iterations);
+    } else {
+        printf("  skipped sysfs: %s\n", strerror(errno));
+    }
+    memset(ec_io_stats, 0, sizeof(ec_io_stats));
+    for (int i = 0; i < iterations; i++) {
+        uint64_t begin_ns = get_monotonic_ns();
+        ec_io_read_registers(ec_sample_regs, ec_sample_reg_count, buf);
+        samples[i] = get_monotonic_ns() - begin_ns;
+    }
+    main_bench_report("port I/O", samples, iterations);
+    // writes back the duty the EC reports, the fans keep their speed
+    if (ec_io_read_registers(ec_sample_regs, ec_sample_reg_count, buf)
+            == EXIT_SUCCESS) {
+        memset(ec_io_stats, 0, sizeof(ec_io_stats));
+        for (int i = 0; i < iterations; i++) {
+            uint64_t begin_ns = get_monotonic_ns();
+            for (int j = 0; j < ec_profile->fan_count; j++)
+                ec_hw_write_fan_duty(j, buf[ec_profile->fans[j].duty_reg]);
+            samples[i] = get_monotonic_ns() - begin_ns;
+        }
+        main_bench_report("port write", samples, iterations);
+    } else {
+        printf("  skipped port write: %s\n", strerror(errno));
+    }
+    free(samples);
+    return EXIT_SUCCESS;
+}
 
-    //wait_ec(EC_SC, EC_SC_IBF_FREE);
-    ec_io_wait(EC_SC, OBF, 1);
-    uint8_t value = inb(EC_DATA);
+static void main_bench_report(const char* name, uint64_t* samples, int count) {
+    qsort(samples, count, sizeof(uint64_t), &compare_uint64);
+    uint64_t waits = 0, sleeps = 0, timeouts = 0;
+    for (int i = 0; i < EC_IO_PHASE_COUNT; i++) {
+        waits += ec_io_stats[i].count;
+        sleeps += ec_io_stats[i].sleeps;
+        timeouts += ec_io_stats[i].timeouts;
+    }
+    printf("  %-12s min=%.1fus median=%.1fus p99=%.1fus max=%.1fus", name,
+            samples[0] / 1000.0, samples[count / 2] / 1000.0,
+            samples[(count - 1) * 99 / 100] / 1000.0,
+            samples[count - 1] / 1000.0);
+    if (waits > 0)
+        printf(" waits=%lu sleeps=%lu timeouts=%lu", (unsigned long) waits,
+                (unsigned long) sleeps, (unsigned long) timeouts);
+    printf("\n");
+}
+
+static gboolean ui_update(gpointer user_data) {
+    struct ec_sample sample;
+    share_read_sample(&sample);
+    // follow mode changes from the socket or the command line
+    static int ui_fan_duty = 0;
+    static int ui_control = CONTROL_CURVE;
+    int fan_duty = sample.auto_duty ? 0 : sample.manual_duty;
+    if (fan_duty != ui_fan_duty || sample.control != ui_control) {
+        ui_fan_duty = fan_duty;
+        ui_control = sample.control;
+        ui_toggle_menuitems(fan_duty, sample.control);
+    }
+    ui_update_fans(&sample);
+    // label and icon are sent over D-Bus, only when they change
+    static char ui_label[256] = "";
+    static char ui_icon_name[256] = "";
+    char label[256] = "";
+    for (int i = 0; i < sample.sensor_count && i < EC_MAX_SENSORS; i++)
+        sprintf(label + strlen(label), i == 0 ? "%d℃" : " %d℃",
+                sample.temps[i]);
+    if (strcmp(label, ui_label) != 0) {
+        strcpy(ui_label, label);
+        app_indicator_set_label(indicator, label, "XXXXXX");
+    }
+    char icon_name[256];
+    double load = 0;
+    for (int i = 0; i < ec_profile->fan_count; i++)
+        load = MAX(load, ((double) sample.fan_rpms[i])
+                / ec_profile->fans[i].max_rpms * 100.0);
+    double load_r = round(load / 5.0) * 5.0;
+    sprintf(icon_name, "brasero-disc-%02d", (int) load_r);
+    if (strcmp(icon_name, ui_icon_name) != 0) {
+        strcpy(ui_icon_name, icon_name);
+        app_indicator_set_icon(indicator, icon_name);
+    }
+    ui_update_peak();
+    return G_SOURCE_CONTINUE;
+}
 
-    return value;
+static gboolean ui_on_event(gint fd, GIOCondition condition,
+        gpointer user_data) {
+    uint64_t count;
+    read(fd, &count, sizeof(count));
+    return ui_update(user_data);
 }
 
-static int ec_io_do(const uint32_t cmd, const uint32_t port,
-        const uint8_t value) {
-    ec_io_wait(EC_SC, IBF, 0);
-    outb(cmd, EC_SC);
+static gboolean ui_on_peak_timeout(gpointer user_data) {
+    ui_peak_source = 0;
+    ui_update_peak();
+    return G_SOURCE_REMOVE;
+}
 
-    ec_io_wait(EC_SC, IBF, 0);
-    outb(port, EC_DATA);
+/* shows the highest temperatures of the last minute from the history, which
+ * catches spikes between two indicator updates; without new samples to wake
+ * the indicator, a timeout refreshes it when the peak leaves the window */
+static void ui_update_peak(void) {
+    static struct ec_history_record records[512];
+    int count = share_read_history(0, records, 512, NULL);
+    if (count == 0)
+        return;
+    uint64_t newest_ns = get_monotonic_ns();
+    int sensor_count = ec_profile->sensor_count;
+    int peaks[EC_MAX_SENSORS] = { 0 };
+    uint64_t peak_ns[EC_MAX_SENSORS];
+    for (int j = 0; j < sensor_count; j++)
+        peak_ns[j] = newest_ns;
+    for (int i = count - 1; i >= 0; i--) {
+        if (newest_ns - records[i].timestamp_ns > EC_HISTORY_PEAK_NS)
+            break;
+        for (int j = 0; j < sensor_count; j++) {
+            if (records[i].temps[j] > peaks[j]) {
+                peaks[j] = records[i].temps[j];
+                peak_ns[j] = records[i].timestamp_ns;
+            }
+        }
+    }
+    uint64_t expire_ns = newest_ns;
+    for (int j = 0; j < sensor_count; j++)
+        expire_ns = MIN(expire_ns, peak_ns[j]);
+    expire_ns += EC_HISTORY_PEAK_NS;
+    if (ui_peak_source != 0)
+        g_source_remove(ui_peak_source);
+    guint delay_ms = expire_ns > newest_ns ?
+            (guint) MIN((expire_ns - newest_ns) / 1000000 + 1,
+                    UI_PEAK_DELAY_MAX_MS) : UI_PEAK_DELAY_MAX_MS;
+    ui_peak_source = g_timeout_add(delay_ms, &ui_on_peak_timeout, NULL);
+    for (int i = 0; i < menuitem_count; i++) {
+        if (menuitems[i].type != INFO || menuitems[i].widget == NULL)
+            continue;
+        char label[256] = "Peak 1 min:";
+        for (int j = 0; j < sensor_count; j++)
+            sprintf(label + strlen(label), " %d℃", peaks[j]);
+        if (strcmp(label, menuitems[i].label) == 0)
+            continue;
+        strcpy(menuitems[i].label, label);
+        gtk_menu_item_set_label(GTK_MENU_ITEM(menuitems[i].widget), label);
+    }
+}
 
-    ec_io_wait(EC_SC, IBF, 0);
-    outb(value, EC_DATA);
+static void ui_command_set_fan(long fan_duty) {
+    int fan_duty_val = (int) fan_duty;
+    if (fan_duty_val == 0) {
+        printf("clicked on fan duty auto\n");
+        share_push_command(EC_COMMAND_AUTO, 0);
+    } else {
+        printf("clicked on fan duty: %d\n", fan_duty_val);
+        share_push_command(EC_COMMAND_MANUAL, fan_duty_val);
+    }
+    main_notify_worker();
+    struct ec_sample sample;
+    share_read_sample(&sample);
+    ui_toggle_menuitems(fan_duty_val, sample.control);
+}
 
-    return ec_io_wait(EC_SC, IBF, 0);
+static void ui_command_set_control(long control) {
+    printf("clicked on %s control\n", control == CONTROL_PID ? "PID" : "curve");
+    share_push_command(EC_COMMAND_CONTROL, (int) control);
+    main_notify_worker();
+    struct ec_sample sample;
+    share_read_sample(&sample);
+    ui_toggle_menuitems(sample.auto_duty ? 0 : sample.manual_duty,
+            (int) control);
 }
 
-static int calculate_fan_duty(int raw_duty) {
-    return (int) ((double) raw_duty / 255.0 * 100.0);
+static void ui_command_history(gchar* command) {
+    if (ui_graph.window == NULL) {
+        ui_graph.window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+        gtk_window_set_title(GTK_WINDOW(ui_graph.window), "Clevo History");
+        gtk_window_set_resizable(GTK_WINDOW(ui_graph.window), FALSE);
+        ui_graph.area = gtk_drawing_area_new();
+        gtk_widget_set_size_request(ui_graph.area, UI_GRAPH_WIDTH,
+                UI_GRAPH_HEIGHT);
+        gtk_container_add(GTK_CONTAINER(ui_graph.window), ui_graph.area);
+        g_signal_connect(ui_graph.area, "draw", G_CALLBACK(ui_graph_on_draw),
+                NULL);
+        g_signal_connect(ui_graph.window, "delete-event",
+                G_CALLBACK(gtk_widget_hide_on_delete), NULL);
+        g_signal_connect(ui_graph.window, "hide", G_CALLBACK(ui_graph_on_hide),
+                NULL);
+        ui_graph.surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+                UI_GRAPH_WIDTH, UI_GRAPH_HEIGHT);
+        cairo_t* cr = cairo_create(ui_graph.surface);
+        cairo_set_source_rgb(cr, 0.1, 0.1, 0.1);
+        cairo_paint(cr);
+        cairo_destroy(cr);
+        for (int i = 0; i < EC_MAX_SENSORS; i++)
+            ui_graph.prev_temps[i] = -1;
+    }
+    // catches up with the history recorded while hidden
+    ui_graph_update();
+    if (ui_graph.timer == 0)
+        ui_graph.timer = g_timeout_add(UI_GRAPH_COLUMN_NS / 1000000,
+                &ui_graph_on_timeout, NULL);
+    gtk_widget_show_all(ui_graph.window);
+    gtk_window_present(GTK_WINDOW(ui_graph.window));
 }
 
-static int calculate_fan_rpms(int raw_rpm_high, int raw_rpm_low) {
-    int raw_rpm = (raw_rpm_high << 8) + raw_rpm_low;
-    return raw_rpm > 0 ? (2156220 / raw_rpm) : 0;
+static void ui_command_quit(gchar* command) {
+    printf("clicked on quit\n");
+    gtk_main_quit();
+}
+
+static void ui_toggle_menuitems(int fan_duty, int control) {
+    for (int i = 0; i < menuitem_count; i++) {
+        if (menuitems[i].widget == NULL)
+            continue;
+        if (menuitems[i].type == INFO)
+            gtk_widget_set_sensitive(menuitems[i].widget, FALSE);
+        else if (menuitems[i].type == CONTROL)
+            gtk_widget_set_sensitive(menuitems[i].widget,
+                    (int) menuitems[i].option != control);
+        else if (fan_duty == 0)
+            gtk_widget_set_sensitive(menuitems[i].widget,
+                    menuitems[i].type != AUTO);
+        else
+            gtk_widget_set_sensitive(menuitems[i].widget,
+                    menuitems[i].type != MANUAL
+                            || (int) menuitems[i].option != fan_duty);
+    }
+}
+
+/* a single fan keeps the "FAN" name of the other entries */
+static void ui_update_fans(const struct ec_sample* sample) {
+    static char labels[EC_MAX_FANS][64];
+    for (int i = 0; i < ec_profile->fan_count; i++) {
+        if (ui_fan_items[i] == NULL)
+            continue;
+        char label[64];
+        if (ec_profile->fan_count == 1)
+            snprintf(label, sizeof(label), "FAN: %d%% %d RPM",
+                    sample->fan_duty[i], sample->fan_rpms[i]);
+        else
+            snprintf(label, sizeof(label), "%s FAN: %d%% %d RPM",
+                    ec_profile->fans[i].name, sample->fan_duty[i],
+                    sample->fan_rpms[i]);
+        if (strcmp(label, labels[i]) == 0)
+            continue;
+        strcpy(labels[i], label);
+        gtk_menu_item_set_label(GTK_MENU_ITEM(ui_fan_items[i]), label);
+    }
+}
+
+/* folds the new history records into columns and draws the completed ones,
+ * the column in progress is drawn once the next one starts */
+static void ui_graph_update(void) {
+    static struct ec_history_record records[EC_HISTORY_SIZE];
+    int count = share_read_history(ui_graph.history_next, records,
+            EC_HISTORY_SIZE, &ui_graph.history_next);
+    int drawn = 0;
+    for (int i = 0; i < count; i++) {
+        uint64_t column = records[i].timestamp_ns / UI_GRAPH_COLUMN_NS;
+        if (column != ui_graph.column) {
+            if (ui_graph.column != 0) {
+                ui_graph_draw_column(ui_graph.column % UI_GRAPH_WIDTH);
+                drawn = 1;
+            }
+            // columns without samples stay empty, at most the whole width
+            for (uint64_t empty = ui_graph.column + 1;
+                    ui_graph.column != 0 && empty < column
+                            && empty <= ui_graph.column + UI_GRAPH_WIDTH;
+                    empty++) {
+                ui_graph.duty = -1;
+                ui_graph_draw_column(empty % UI_GRAPH_WIDTH);
+            }
+            ui_graph.column = column;
+            ui_graph.duty = 0;
+            for (int j = 0; j < EC_MAX_SENSORS; j++)
+                ui_graph.temps[j] = -1;
+        }
+        for (int j = 0; j < ec_profile->sensor_count; j++)
+            ui_graph.temps[j] = MAX(ui_graph.temps[j], records[i].temps[j]);
+        for (int j = 0; j < ec_profile->fan_count; j++)
+            ui_graph.duty = MAX(ui_graph.duty, records[i].fan_duty[j]);
+    }
+    if (drawn && ui_graph.area != NULL)
+        gtk_widget_queue_draw(ui_graph.area);
+}
+
+/* fan duty as a bar from the bottom, temperatures as lines joined to the
+ * previous column; a duty of -1 clears the column */
+static void ui_graph_draw_column(int x) {
+    cairo_t* cr = cairo_create(ui_graph.surface);
+    cairo_set_source_rgb(cr, 0.1, 0.1, 0.1);
+    cairo_rectangle(cr, x, 0, 1, UI_GRAPH_HEIGHT);
+    cairo_fill(cr);
+    if (ui_graph.duty < 0) {
+        for (int i = 0; i < EC_MAX_SENSORS; i++)
+            ui_graph.prev_temps[i] = -1;
+        cairo_destroy(cr);
+        return;
+    }
+    double bar = UI_GRAPH_HEIGHT * ui_graph.duty / 100.0;
+    cairo_set_source_rgb(cr, 0.25, 0.25, 0.3);
+    cairo_rectangle(cr, x, UI_GRAPH_HEIGHT - bar, 1, bar);
+    cairo_fill(cr);
+    for (int i = 0; i < ec_profile->sensor_count; i++) {
+        int temp = MAX(UI_GRAPH_TEMP_MIN,
+                MIN(ui_graph.temps[i], UI_GRAPH_TEMP_MAX));
+        int y = UI_GRAPH_HEIGHT - 1 - (temp - UI_GRAPH_TEMP_MIN)
+                * (UI_GRAPH_HEIGHT - 1)
+                / (UI_GRAPH_TEMP_MAX - UI_GRAPH_TEMP_MIN);
+        int prev_y = ui_graph.prev_temps[i] >= 0 ? ui_graph.prev_temps[i] : y;
+        const double* color = ui_graph_colors[i];
+        cairo_set_source_rgb(cr, color[0], color[1], color[2]);
+        cairo_rectangle(cr, x, MIN(y, prev_y), 1, abs(y - prev_y) + 1);
+        cairo_fill(cr);
+        ui_graph.prev_temps[i] = y;
+    }
+    cairo_destroy(cr);
+}
+
+/* the oldest column is right after the one in progress */
+static gboolean ui_graph_on_draw(GtkWidget* widget, cairo_t* cr,
+        gpointer user_data) {
+    int oldest = (ui_graph.column + 1) % UI_GRAPH_WIDTH;
+    cairo_set_source_surface(cr, ui_graph.surface, -oldest, 0);
+    cairo_rectangle(cr, 0, 0, UI_GRAPH_WIDTH - oldest, UI_GRAPH_HEIGHT);
+    cairo_fill(cr);
+    cairo_set_source_surface(cr, ui_graph.surface, UI_GRAPH_WIDTH - oldest, 0);
+    cairo_rectangle(cr, UI_GRAPH_WIDTH - oldest, 0, oldest, UI_GRAPH_HEIGHT);
+    cairo_fill(cr);
+    // grid every 20°C, then the legend in the sensor colors
+    cairo_set_source_rgba(cr, 1, 1, 1, 0.3);
+    cairo_set_font_size(cr, 10);
+    for (int temp = UI_GRAPH_TEMP_MIN + 20; temp < UI_GRAPH_TEMP_MAX;
+            temp += 20) {
+        double y = UI_GRAPH_HEIGHT - 1 - (temp - UI_GRAPH_TEMP_MIN)
+                * (UI_GRAPH_HEIGHT - 1.0)
+                / (UI_GRAPH_TEMP_MAX - UI_GRAPH_TEMP_MIN) + 0.5;
+        char text[16];
+        snprintf(text, sizeof(text), "%d℃", temp);
+        cairo_move_to(cr, 0, y);
+        cairo_line_to(cr, UI_GRAPH_WIDTH, y);
+        cairo_stroke(cr);
+        cairo_move_to(cr, 2, y - 2);
+        cairo_show_text(cr, text);
+    }
+    double x = 2;
+    for (int i = 0; i < ec_profile->sensor_count; i++) {
+        const double* color = ui_graph_colors[i];
+        cairo_text_extents_t extents;
+        cairo_set_source_rgb(cr, color[0], color[1], color[2]);
+        cairo_move_to(cr, x, 12);
+        cairo_show_text(cr, ec_profile->sensors[i].name);
+        cairo_text_extents(cr, ec_profile->sensors[i].name, &extents);
+        x += extents.x_advance + 8;
+    }
+    cairo_set_source_rgb(cr, 0.6, 0.6, 0.7);
+    cairo_move_to(cr, x, 12);
+    cairo_show_text(cr, "over fan duty, last 10 minutes");
+    return FALSE;
+}
+
+static gboolean ui_graph_on_timeout(gpointer user_data) {
+    ui_graph_update();
+    return G_SOURCE_CONTINUE;
+}
+
+static void ui_graph_on_hide(GtkWidget* widget, gpointer user_data) {
+    if (ui_graph.timer != 0)
+        g_source_remove(ui_graph.timer);
+    ui_graph.timer = 0;
+}
+
+static int ec_init(void) {
+    if (ioperm(EC_DATA, 1, 1) != 0)
+        return EXIT_FAILURE;
+    if (ioperm(EC_SC, 1, 1) != 0)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+static int ec_sysfs_open(void) {
+    if (ec_sysfs_fd >= 0)
+        close(ec_sysfs_fd);
+    ec_sysfs_fd = open(EC_SYSFS_IO, O_RDONLY | O_CLOEXEC, 0);
+    return ec_sysfs_fd < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* opens the io node, loading ec_sys first if needed; only a module just
+ * loaded is waited for */
+static int ec_sysfs_prepare(void) {
+    int timeout_ms = 0;
+    if (access(EC_SYS_MODULE, F_OK) != 0) {
+        if (ec_sysfs_load_module() != EXIT_SUCCESS)
+            printf("unable to load ec_sys: %s\n", strerror(errno));
+        else
+            timeout_ms = EC_SYSFS_WAIT_MS;
+    }
+    if (ec_sysfs_wait(timeout_ms) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    return ec_sysfs_open();
+}
+
+/* loads ec_sys by finit_module() on the module file of the running kernel or
+ * else by running modprobe */
+static int ec_sysfs_load_module(void) {
+    static const char* const suffixes[] = { "", ".zst", ".xz", ".gz" };
+    struct utsname uts;
+    if (uname(&uts) == 0) {
+        for (int i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+            char path[256];
+            snprintf(path, sizeof(path), EC_SYS_MODULE_FILE, uts.release,
+                    suffixes[i]);
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                continue;
+            // compressed modules need the kernel to decompress them (6.4+)
+            int result = syscall(SYS_finit_module, fd, "",
+                    i == 0 ? 0 : MODULE_INIT_COMPRESSED_FILE);
+            close(fd);
+            if (result == 0 || errno == EEXIST)
+                return EXIT_SUCCESS;
+            break;
+        }
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+        return EXIT_FAILURE;
+    if (pid == 0) {
+        execlp("modprobe", "modprobe", "ec_sys", (char*) NULL);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        return EXIT_FAILURE;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        errno = ENOENT;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* waits for the io node to appear, watching the deepest existing directory
+ * of its path */
+static int ec_sysfs_wait(int timeout_ms) {
+    if (access(EC_SYSFS_IO, R_OK) == 0)
+        return EXIT_SUCCESS;
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0)
+        return EXIT_FAILURE;
+    uint64_t deadline_ns = get_monotonic_ns() + timeout_ms * 1000000ULL;
+    int result = EXIT_FAILURE;
+    for (;;) {
+        char dir[sizeof(EC_SYSFS_IO)] = EC_SYSFS_IO;
+        int wd = -1;
+        while (wd < 0 && strrchr(dir, '/') != dir) {
+            *strrchr(dir, '/') = '\0';
+            wd = inotify_add_watch(fd, dir, IN_CREATE | IN_ONLYDIR);
+        }
+        // the node may have appeared before the watch was added
+        if (access(EC_SYSFS_IO, R_OK) == 0) {
+            result = EXIT_SUCCESS;
+            break;
+        }
+        uint64_t now_ns = get_monotonic_ns();
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (wd < 0 || now_ns >= deadline_ns
+                || poll(&pfd, 1, (deadline_ns - now_ns) / 1000000) <= 0)
+            break;
+        char events[4096];
+        while (read(fd, events, sizeof(events)) > 0)
+            ;
+        inotify_rm_watch(fd, wd);
+    }
+    close(fd);
+    if (result != EXIT_SUCCESS)
+        errno = ENOENT;
+    return result;
+}
+
+static ssize_t ec_sysfs_read(uint8_t* buf) {
+    memset(buf, 0, EC_REG_SIZE);
+    ssize_t total = 0;
+    for (int i = 0; i < ec_sysfs_range_count; i++) {
+        uint8_t offset = ec_sysfs_ranges[i].offset;
+        uint8_t length = ec_sysfs_ranges[i].length;
+        ssize_t len = pread(ec_sysfs_fd, buf + offset, length, offset);
+        if (len < 0 && (errno == EBADF || errno == ENOENT || errno == ENODEV
+                || errno == EIO)) {
+            // file gone after reloading ec_sys, reopen once and retry
+            if (ec_sysfs_open() != EXIT_SUCCESS)
+                return -1;
+            len = pread(ec_sysfs_fd, buf + offset, length, offset);
+        }
+        if (len < 0)
+            return -1;
+        if (len != length) {
+            printf("wrong EC size from sysfs: %ld at 0x%02x\n", len, offset);
+            errno = EIO;
+            return -1;
+        }
+        total += len;
+    }
+    return total;
+}
+
+static void ec_on_sigterm(int signum) {
+    printf("ec on signal: %s\n", strsignal(signum));
+    if (share_info != NULL)
+        share_info->exit = 1;
+    main_notify_worker();
+}
+
+/* returns the next duty of the fan in auto mode, or 0 to keep the current
+ * one */
+static int ec_auto_duty_adjust(const struct ec_sample* sample, int fan,
+        uint64_t now_ns) {
+    if (config.control == CONTROL_PID)
+        return control_pid(sample, fan, now_ns);
+    return control_curve(sample, fan);
+}
+
+static int control_curve(const struct ec_sample* sample, int fan) {
+    const struct fan_curve* curve = &fan_controls[fan].curve;
+    int temp = sample_fan_temp(sample, fan);
+    int duty = sample->fan_duty[fan];
+    temp = MAX(0, MIN(temp, 255));
+    // feed-forward raises the floor of the curve in 5% steps
+    int floor = MIN_FAN_DUTY
+            + (int) round(control_feedforward(sample, fan) / 5) * 5;
+    floor = MIN(floor, MAX_FAN_DUTY);
+    //
+    if (curve->up[temp] > duty || floor > duty)
+        return MAX(curve->up[temp], floor);
+    if (curve->down[temp] < duty)
+        return MAX(curve->down[temp], floor);
+    //
+    return 0;
+}
+
+/* duty percents above the minimum from the load of the sensors of the fan,
+ * CPU load and package power for "cpu", GPU load for "gpu" */
+static double control_feedforward(const struct ec_sample* sample, int fan) {
+    double duty = 0;
+    for (int i = 0; i < ec_profile->sensor_count; i++) {
+        if (!(fan_controls[fan].sensor_mask & (1u << i)))
+            continue;
+        const char* name = ec_profile->sensors[i].name;
+        double sensor_duty = 0;
+        if (strcmp(name, "cpu") == 0) {
+            if (sample->cpu_load >= 0)
+                sensor_duty += config.feedforward_load
+                        * MAX(0, sample->cpu_load - FEEDFORWARD_LOAD_IDLE);
+            if (sample->package_power_mw >= 0)
+                sensor_duty += config.feedforward_power
+                        * MAX(0.0, sample->package_power_mw / 1000.0
+                                - config.feedforward_power_idle);
+        } else if (strcmp(name, "gpu") == 0 && sample->gpu_load >= 0) {
+            sensor_duty = config.feedforward_load
+                    * MAX(0, sample->gpu_load - FEEDFORWARD_LOAD_IDLE);
+        }
+        duty = MAX(duty, sensor_duty);
+    }
+    return MIN(duty, MAX_FAN_DUTY - MIN_FAN_DUTY);
+}
+
+/* PID on the temperature above the setpoint, with the derivative taken from
+ * the history trend so the fan ramps up before the temperature peaks, plus
+ * the load feed-forward. The integral stops growing while the output is
+ * saturated (anti-windup) and the output is quantized to limit EC writes. */
+static int control_pid(const struct ec_sample* sample, int fan,
+        uint64_t now_ns) {
+    struct pid_state* pid_state = &fan_controls[fan].pid;
+    double temp = sample_fan_temp(sample, fan);
+    double error = temp - config.pid_setpoint;
+    double slope = history_temp_slope(sample, fan_controls[fan].sensor_mask,
+            now_ns, PID_TREND_WINDOW_NS);
+    double dt = pid_state->last_ns == 0 ? 0 :
+            (now_ns - pid_state->last_ns) / 1e9;
+    pid_state->last_ns = now_ns;
+    //
+    double range = MAX_FAN_DUTY - MIN_FAN_DUTY;
+    double p_d = config.pid_kp * error + config.pid_kd * slope
+            + control_feedforward(sample, fan);
+    double integral = pid_state->integral + config.pid_ki * error * dt;
+    integral = MAX(0.0, MIN(integral, range));
+    double output = p_d + integral;
+    if ((output < range || error < 0) && (output > 0 || error > 0))
+        pid_state->integral = integral;
+    output = MAX(0.0, MIN(p_d + pid_state->integral, range));
+    //
+    int step = config.pid_duty_step;
+    int duty = MIN_FAN_DUTY + (int) round(output / step) * step;
+    return MIN(duty, MAX_FAN_DUTY);
+}
+
+static void control_reset(void) {
+    for (int i = 0; i < EC_MAX_FANS; i++)
+        memset(&fan_controls[i].pid, 0, sizeof(fan_controls[i].pid));
+}
+
+/* least-squares slope in °C/s of the hottest sensor of the mask over the
+ * recent history and the current sample */
+static double history_temp_slope(const struct ec_sample* sample,
+        unsigned sensor_mask, uint64_t now_ns, uint64_t window_ns) {
+    static struct ec_history_record records[PID_TREND_RECORDS];
+    int count = share_read_history(0, records, PID_TREND_RECORDS, NULL);
+    double n = 1, sum_t = 0, sum_v = 0;
+    for (int j = 0; j < ec_profile->sensor_count; j++) {
+        if (sensor_mask & (1u << j))
+            sum_v = MAX(sum_v, sample->temps[j]);
+    }
+    double sum_tt = 0, sum_tv = 0;
+    for (int i = count - 1; i >= 0; i--) {
+        if (now_ns - records[i].timestamp_ns > window_ns)
+            break;
+        double t = -((now_ns - records[i].timestamp_ns) / 1e9);
+        double v = 0;
+        for (int j = 0; j < ec_profile->sensor_count; j++) {
+            if (sensor_mask & (1u << j))
+                v = MAX(v, records[i].temps[j]);
+        }
+        n++;
+        sum_t += t;
+        sum_v += v;
+        sum_tt += t * t;
+        sum_tv += t * v;
+    }
+    double denominator = n * sum_tt - sum_t * sum_t;
+    if (n < 3 || denominator <= 0)
+        return 0;
+    return (n * sum_tv - sum_t * sum_v) / denominator;
+}
+
+/* step curves hold the duty of a point until the next one, linear curves
+ * interpolate between points; both are flat outside of the points and
+ * clamped to the writable duty range. Slowing down happens only when the
+ * temperature dropped by the hysteresis below where the duty was reached. */
+static void curve_compile(struct fan_curve* curve,
+        const struct curve_point* points, int count, int step, int hysteresis) {
+    for (int t = 0; t < 256; t++) {
+        int duty = points[0].duty;
+        int i = 0;
+        while (i < count && points[i].temp <= t)
+            duty = points[i++].duty;
+        if (!step && i > 0 && i < count) {
+            const struct curve_point* p0 = &points[i - 1];
+            const struct curve_point* p1 = &points[i];
+            duty = p0->duty
+                    + (p1->duty - p0->duty) * (t - p0->temp)
+                            / (p1->temp - p0->temp);
+        }
+        curve->up[t] = MAX(MIN_FAN_DUTY, MIN(duty, MAX_FAN_DUTY));
+    }
+    for (int t = 0; t < 256; t++)
+        curve->down[t] = curve->up[MIN(t + MAX(hysteresis - 1, 0), 255)];
+}
+
+/* parses "temp:duty temp:duty ..." with ascending temperatures */
+static int curve_parse(const char* text, struct curve_point* points, int max) {
+    int count = 0;
+    const char* p = text;
+    int temp, duty, len;
+    while (sscanf(p, " %d:%d%n", &temp, &duty, &len) == 2) {
+        if (count >= max || temp < 0 || temp > 255 || duty < 0 || duty > 100
+                || (count > 0 && temp <= points[count - 1].temp))
+            return -1;
+        points[count].temp = temp;
+        points[count].duty = duty;
+        count++;
+        p += len;
+    }
+    while (*p == ' ' || *p == '\t')
+        p++;
+    return *p == '\0' ? count : -1;
+}
+
+/* by the "profile" setting, or the first profile matching the DMI board name,
+ * or the default one */
+static const struct ec_profile* profile_select(const char* name) {
+    if (name != NULL) {
+        for (int i = 0; i < ec_profile_count; i++) {
+            if (strcmp(ec_profiles[i].name, name) == 0)
+                return &ec_profiles[i];
+        }
+        return NULL;
+    }
+    char board_name[128] = "";
+    FILE* fp = fopen(DMI_BOARD_NAME, "r");
+    if (fp != NULL) {
+        if (fgets(board_name, sizeof(board_name), fp) == NULL)
+            board_name[0] = '\0';
+        board_name[strcspn(board_name, "\n")] = '\0';
+        fclose(fp);
+    }
+    for (int i = 0; i < ec_profile_count && strlen(board_name) > 0; i++) {
+        const char* p = ec_profiles[i].board_names;
+        while (p != NULL && *p != '\0') {
+            size_t len = strcspn(p, " ");
+            if (len > 0 && strncmp(board_name, p, len) == 0)
+                return &ec_profiles[i];
+            p += len;
+            p += strspn(p, " ");
+        }
+    }
+    return &ec_profiles[0];
+}
+
+/* collects the registers of the profile in ascending order and merges them
+ * into sysfs ranges */
+static void profile_compile(const struct ec_profile* profile) {
+    uint8_t used[EC_REG_SIZE] = { 0 };
+    for (int i = 0; i < profile->sensor_count; i++)
+        used[profile->sensors[i].reg] = 1;
+    for (int i = 0; i < profile->fan_count; i++) {
+        used[profile->fans[i].duty_reg] = 1;
+        used[profile->fans[i].rpms_hi_reg] = 1;
+        used[profile->fans[i].rpms_lo_reg] = 1;
+    }
+    ec_profile = profile;
+    ec_sample_reg_count = 0;
+    ec_sysfs_range_count = 0;
+    for (int reg = 0; reg < EC_REG_SIZE; reg++) {
+        if (!used[reg])
+            continue;
+        ec_sample_regs[ec_sample_reg_count++] = reg;
+        if (ec_sysfs_range_count > 0) {
+            int offset = ec_sysfs_ranges[ec_sysfs_range_count - 1].offset;
+            int length = ec_sysfs_ranges[ec_sysfs_range_count - 1].length;
+            if (reg - (offset + length) <= EC_SYSFS_RANGE_GAP) {
+                ec_sysfs_ranges[ec_sysfs_range_count - 1].length = reg - offset
+                        + 1;
+                continue;
+            }
+        }
+        ec_sysfs_ranges[ec_sysfs_range_count].offset = reg;
+        ec_sysfs_ranges[ec_sysfs_range_count].length = 1;
+        ec_sysfs_range_count++;
+    }
+}
+
+static int sample_max_temp(const struct ec_sample* sample) {
+    int temp = sample->temps[0];
+    for (int i = 1; i < sample->sensor_count && i < EC_MAX_SENSORS; i++)
+        temp = MAX(temp, sample->temps[i]);
+    return temp;
+}
+
+static int sample_fan_temp(const struct ec_sample* sample, int fan) {
+    int temp = 0;
+    for (int i = 0; i < sample->sensor_count && i < EC_MAX_SENSORS; i++) {
+        if (fan_controls[fan].sensor_mask & (1u << i))
+            temp = MAX(temp, sample->temps[i]);
+    }
+    return temp;
+}
+
+/* every signal is optional, missing ones stay at -1 */
+static void load_open(void) {
+    struct load_sampler* s = &load_sampler;
+    char path[128];
+    s->stat_fd = open(PROC_STAT, O_RDONLY | O_CLOEXEC);
+    for (int i = 0; i < RAPL_MAX_PACKAGES; i++) {
+        snprintf(path, sizeof(path), RAPL_MAX_ENERGY, i);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        s->rapl_ranges[i] = 0;
+        if (fd >= 0) {
+            load_read_u64(fd, &s->rapl_ranges[i]);
+            close(fd);
+        }
+        snprintf(path, sizeof(path), RAPL_ENERGY, i);
+        s->rapl_fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+        s->rapl_energies[i] = 0;
+        if (s->rapl_fds[i] >= 0)
+            load_read_u64(s->rapl_fds[i], &s->rapl_energies[i]);
+    }
+    for (int i = 0; i < DRM_MAX_CARDS && s->gpu_fd < 0; i++) {
+        snprintf(path, sizeof(path), DRM_GPU_BUSY, i);
+        s->gpu_fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    s->last_ns = get_monotonic_ns();
+    load_sample(NULL, s->last_ns);
+}
+
+static void load_close(void) {
+    struct load_sampler* s = &load_sampler;
+    if (s->stat_fd >= 0)
+        close(s->stat_fd);
+    for (int i = 0; i < RAPL_MAX_PACKAGES; i++) {
+        if (s->rapl_fds[i] >= 0)
+            close(s->rapl_fds[i]);
+        s->rapl_fds[i] = -1;
+    }
+    if (s->gpu_fd >= 0)
+        close(s->gpu_fd);
+    s->stat_fd = s->gpu_fd = -1;
+}
+
+/* updates the loads of the sample since the previous call, NULL to only
+ * take the initial counters */
+static void load_sample(struct ec_sample* sample, uint64_t now_ns) {
+    struct load_sampler* s = &load_sampler;
+    double elapsed_s = (now_ns - s->last_ns) / 1e9;
+    s->last_ns = now_ns;
+    // "cpu  user nice system idle iowait irq softirq steal"
+    char buf[256];
+    int cpu_load = -1;
+    ssize_t len = s->stat_fd >= 0 ? pread(s->stat_fd, buf, sizeof(buf) - 1, 0) :
+            -1;
+    if (len > 0) {
+        buf[len] = '\0';
+        unsigned long long v[8] = { 0 };
+        if (sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0],
+                &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) >= 4) {
+            uint64_t total = 0;
+            for (int i = 0; i < 8; i++)
+                total += v[i];
+            uint64_t busy = total - v[3] - v[4];
+            if (total > s->total)
+                cpu_load = (int) round(100.0 * (busy - s->busy)
+                        / (total - s->total));
+            s->busy = busy;
+            s->total = total;
+        }
+    }
+    int package_power_mw = -1;
+    double energy_uj = 0;
+    for (int i = 0; i < RAPL_MAX_PACKAGES; i++) {
+        uint64_t energy;
+        if (s->rapl_fds[i] < 0 || load_read_u64(s->rapl_fds[i], &energy) != 0)
+            continue;
+        // the counter wraps at max_energy_range_uj
+        if (energy >= s->rapl_energies[i])
+            energy_uj += energy - s->rapl_energies[i];
+        else if (s->rapl_ranges[i] > 0)
+            energy_uj += s->rapl_ranges[i] - s->rapl_energies[i] + energy;
+        s->rapl_energies[i] = energy;
+        package_power_mw = 0;
+    }
+    if (package_power_mw == 0 && elapsed_s > 0)
+        package_power_mw = (int) (energy_uj / elapsed_s / 1000.0);
+    uint64_t gpu_busy;
+    int gpu_load = -1;
+    if (s->gpu_fd >= 0 && load_read_u64(s->gpu_fd, &gpu_busy) == 0)
+        gpu_load = MIN(gpu_busy, 100);
+    if (sample == NULL)
+        return;
+    sample->cpu_load = cpu_load;
+    sample->gpu_load = gpu_load;
+    sample->package_power_mw = package_power_mw;
 }
 
-static int check_proc_instances(const char* proc_name) {
-    int proc_name_len = strlen(proc_name);
-    pid_t this_pid = getpid();
-    DIR* dir;
-    if (!(dir = opendir("/proc"))) {
-        perror("can't open /proc");
+static int load_read_u64(int fd, uint64_t* value) {
+    char buf[32];
+    ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
         return -1;
+    buf[len] = '\0';
+    char* endptr;
+    *value = strtoull(buf, &endptr, 10);
+    return endptr == buf ? -1 : 0;
+}
+
+/* opt-in: keeps sampling and EC handshakes on time under full load, applied
+ * once everything is opened so that mlockall() covers the working set */
+static void worker_realtime(void) {
+    if (config.worker_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(config.worker_cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+            printf("unable to pin worker to CPU %d: %s\n", config.worker_cpu,
+                    strerror(errno));
     }
-    int instance_count = 0;
-    struct dirent* ent;
-    while ((ent = readdir(dir)) != NULL) {
-        char* endptr;
-        long lpid = strtol(ent->d_name, &endptr, 10);
-        if (*endptr != '\0')
+    if (config.worker_priority > 0) {
+        // children such as modprobe start with the normal policy
+        struct sched_param param = { .sched_priority = config.worker_priority };
+        if (sched_setscheduler(0, config.worker_policy | SCHED_RESET_ON_FORK,
+                &param) != 0)
+            printf("unable to set worker priority %d: %s\n",
+                    config.worker_priority, strerror(errno));
+        else
+            printf("worker scheduled %s at priority %d\n",
+                    config.worker_policy == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO",
+                    config.worker_priority);
+    }
+    if (config.worker_mlock && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        printf("unable to lock worker memory: %s\n", strerror(errno));
+}
+
+/* the minimum interval while temperatures ramp, else doubling up to the
+ * maximum; slower on battery */
+static int worker_interval(int interval_ms, int ramping) {
+    int min_ms = power.on_battery ? WORKER_BATTERY_INTERVAL_MIN_MS :
+            WORKER_INTERVAL_MIN_MS;
+    int max_ms = power.on_battery ?
+            MAX(config.battery_interval_ms, min_ms) : WORKER_INTERVAL_MAX_MS;
+    return ramping ? min_ms : MIN(interval_ms * 2, max_ms);
+}
+
+/* finds the AC adapter and listens to kernel uevents, a machine without one
+ * is never on battery */
+static void power_open(void) {
+    power.sleep_offset_ns = get_boottime_ns() - get_monotonic_ns();
+    DIR* dir = opendir(POWER_SUPPLY_DIR);
+    struct dirent* entry;
+    while (dir != NULL && power.online_fd < 0
+            && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
             continue;
-        if (lpid == this_pid)
+        char path[320];
+        char type[16] = "";
+        snprintf(path, sizeof(path), POWER_SUPPLY_DIR "/%s/type",
+                entry->d_name);
+        FILE* file = fopen(path, "r");
+        if (file == NULL)
             continue;
-        char buf[512];
-        snprintf(buf, sizeof(buf), "/proc/%ld/comm", lpid);
-        FILE* fp = fopen(buf, "r");
-        if (fp) {
-            if (fgets(buf, sizeof(buf), fp) != NULL) {
-                if ((buf[proc_name_len] == '\n' || buf[proc_name_len] == '\0')
-                        && strncmp(buf, proc_name, proc_name_len) == 0) {
-                    fprintf(stderr, "Process: %ld\n", lpid);
-                    instance_count += 1;
-                }
+        if (fgets(type, sizeof(type), file) != NULL)
+            type[strcspn(type, "\n")] = '\0';
+        fclose(file);
+        if (strcmp(type, "Mains") != 0)
+            continue;
+        snprintf(path, sizeof(path), POWER_SUPPLY_DIR "/%s/online",
+                entry->d_name);
+        power.online_fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (dir != NULL)
+        closedir(dir);
+    if (power.online_fd < 0)
+        return;
+    power.uevent_fd = socket(AF_NETLINK,
+            SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    if (power.uevent_fd >= 0
+            && bind(power.uevent_fd, (struct sockaddr*) &addr, sizeof(addr))
+                    != 0) {
+        printf("unable to listen to power supply events: %s\n",
+                strerror(errno));
+        close(power.uevent_fd);
+        power.uevent_fd = -1;
+    }
+    power_read_online();
+}
+
+static void power_close(void) {
+    if (power.uevent_fd >= 0)
+        close(power.uevent_fd);
+    if (power.online_fd >= 0)
+        close(power.online_fd);
+    power.uevent_fd = power.online_fd = -1;
+}
+
+static void power_read_online(void) {
+    uint64_t online;
+    if (load_read_u64(power.online_fd, &online) != 0)
+        return;
+    if (power.on_battery != (online == 0))
+        printf("%s, sampling %s\n", online ? "on AC" : "on battery",
+                online ? "at full rate" : "at low rate");
+    power.on_battery = online == 0;
+}
+
+/* drains the pending uevents, the messages are NUL separated "KEY=value"
+ * strings after an "action@devpath" header */
+static void power_read_uevents(void) {
+    char buf[4096];
+    ssize_t len;
+    int changed = 0;
+    while ((len = recv(power.uevent_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[len] = '\0';
+        for (char* p = buf; p < buf + len; p += strlen(p) + 1)
+            changed |= strcmp(p, "SUBSYSTEM=power_supply") == 0;
+    }
+    if (changed)
+        power_read_online();
+}
+
+/* the time slept since the previous call, 0 if none */
+static uint64_t power_resumed(void) {
+    uint64_t offset_ns = get_boottime_ns() - get_monotonic_ns();
+    uint64_t slept_ns = offset_ns - power.sleep_offset_ns;
+    if (slept_ns < RESUME_DRIFT_NS)
+        return 0;
+    power.sleep_offset_ns = offset_ns;
+    return slept_ns;
+}
+
+/* filters the temps of the sample in place and the fan RPMs into it */
+static void filter_apply(struct ec_sample* sample, const int* fan_rpms,
+        uint64_t now_ns) {
+    double dt_s = filter_last_ns != 0 ? (now_ns - filter_last_ns) / 1e9 : 0;
+    filter_last_ns = now_ns;
+    for (int i = 0; i < ec_profile->sensor_count; i++)
+        sample->temps[i] = filter_value(&temp_filters[i], sample->temps[i],
+                dt_s, config.filter_slew);
+    for (int i = 0; i < ec_profile->fan_count; i++)
+        sample->fan_rpms[i] = filter_value(&rpm_filters[i], fan_rpms[i], dt_s,
+                0);
+}
+
+static int filter_value(struct sample_filter* filter, int input, double dt_s,
+        double slew) {
+    int size = MAX(1, MIN(config.filter_median, FILTER_MAX_MEDIAN));
+    filter->window[filter->next] = input;
+    filter->next = (filter->next + 1) % size;
+    filter->count = MIN(filter->count + 1, size);
+    // insertion sort of at most 9 readings
+    int sorted[FILTER_MAX_MEDIAN];
+    for (int i = 0; i < filter->count; i++) {
+        int j = i;
+        for (; j > 0 && sorted[j - 1] > filter->window[i]; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = filter->window[i];
+    }
+    double value = sorted[filter->count / 2];
+    if (!filter->initialized) {
+        filter->slewed = filter->smoothed = value;
+        filter->initialized = 1;
+        return input;
+    }
+    if (slew > 0) {
+        double limit = slew * dt_s;
+        value = MAX(filter->slewed - limit, MIN(value, filter->slewed + limit));
+    }
+    filter->slewed = value;
+    double alpha = config.filter_ema_ms > 0 ?
+            1 - exp(-dt_s * 1000 / config.filter_ema_ms) : 1;
+    filter->smoothed += alpha * (value - filter->smoothed);
+    return (int) round(filter->smoothed);
+}
+
+/* readings from before a suspend are not continued */
+static void filter_reset(void) {
+    memset(temp_filters, 0, sizeof(temp_filters));
+    memset(rpm_filters, 0, sizeof(rpm_filters));
+    filter_last_ns = 0;
+}
+
+/* binds the temperature chips to the profile sensors by name: coretemp,
+ * k10temp or zenpower to "cpu", amdgpu, nouveau or NVML to "gpu" */
+static void hwmon_open(void) {
+    static const char* const cpu_chips[] = { "coretemp", "k10temp", "zenpower",
+            NULL };
+    static const char* const gpu_chips[] = { "amdgpu", "nouveau", NULL };
+    for (int i = 0; i < ec_profile->sensor_count; i++) {
+        struct hwmon_source* source = &hwmon_sources[i];
+        const char* const* chips = NULL;
+        if (strcmp(ec_profile->sensors[i].name, "cpu") == 0)
+            chips = cpu_chips;
+        else if (strcmp(ec_profile->sensors[i].name, "gpu") == 0)
+            chips = gpu_chips;
+        source->count = 0;
+        source->nvml = 0;
+        for (int chip = 0; chips != NULL && chip < HWMON_MAX_CHIPS
+                && source->count == 0; chip++) {
+            char path[128];
+            char name[16] = "";
+            snprintf(path, sizeof(path), HWMON_NAME, chip);
+            FILE* file = fopen(path, "r");
+            if (file == NULL)
+                continue;
+            if (fgets(name, sizeof(name), file) != NULL)
+                name[strcspn(name, "\n")] = '\0';
+            fclose(file);
+            int known = 0;
+            for (int j = 0; chips[j] != NULL; j++)
+                known |= strcmp(name, chips[j]) == 0;
+            if (!known)
+                continue;
+            // coretemp has one input per package and per core, the cores
+            // jump by several degrees between ticks
+            for (int input = 1; input <= HWMON_MAX_INDEX
+                    && source->count < HWMON_MAX_INPUTS; input++) {
+                if (chips == cpu_chips && !hwmon_is_package(chip, input))
+                    continue;
+                snprintf(path, sizeof(path), HWMON_TEMP_INPUT, chip, input);
+                int fd = open(path, O_RDONLY | O_CLOEXEC);
+                if (fd >= 0)
+                    source->fds[source->count++] = fd;
             }
-            fclose(fp);
+            strcpy(source->chip, name);
+        }
+        if (source->count == 0 && chips == gpu_chips && config.temp_nvml
+                && nvml_open() == 0) {
+            source->nvml = 1;
+            strcpy(source->chip, "nvml");
         }
+        if (source->count > 0 || source->nvml)
+            printf("%s temperature from %s, %d inputs\n",
+                    ec_profile->sensors[i].name, source->chip,
+                    source->nvml ? 1 : source->count);
+    }
+}
+
+static void hwmon_close(void) {
+    for (int i = 0; i < EC_MAX_SENSORS; i++) {
+        for (int j = 0; j < hwmon_sources[i].count; j++)
+            close(hwmon_sources[i].fds[j]);
+        hwmon_sources[i].count = 0;
+        hwmon_sources[i].nvml = 0;
+    }
+    if (nvml.library != NULL) {
+        nvml.shutdown();
+        dlclose(nvml.library);
+        nvml.library = NULL;
+    }
+}
+
+/* the EC reading lags and is coarse: the hotter of both unless only hwmon is
+ * wanted, the EC alone when no other input is readable */
+static void hwmon_fuse(struct ec_sample* sample, const int* ec_temps) {
+    for (int i = 0; i < ec_profile->sensor_count; i++) {
+        int temp = hwmon_read(&hwmon_sources[i]);
+        if (temp < 0)
+            sample->temps[i] = ec_temps[i];
+        else if (config.temp_source == TEMP_SOURCE_HWMON)
+            sample->temps[i] = temp;
+        else
+            sample->temps[i] = MAX(temp, ec_temps[i]);
     }
-    closedir(dir);
-    return instance_count;
+}
+
+/* whether a CPU chip input is the package temperature: "Package id" on
+ * coretemp, "Tctl" on k10temp and zenpower, the first one without labels */
+static int hwmon_is_package(int chip, int input) {
+    char path[128];
+    char label[32] = "";
+    snprintf(path, sizeof(path), HWMON_TEMP_LABEL, chip, input);
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return input == 1 && errno == ENOENT;
+    if (fgets(label, sizeof(label), file) != NULL)
+        label[strcspn(label, "\n")] = '\0';
+    fclose(file);
+    return strncmp(label, "Package id", 10) == 0 || strcmp(label, "Tctl") == 0;
+}
+
+/* °C of the hottest input, -1 if none is readable */
+static int hwmon_read(const struct hwmon_source* source) {
+    if (source->nvml)
+        return nvml_read();
+    int temp = -1;
+    for (int i = 0; i < source->count; i++) {
+        uint64_t millidegrees;
+        if (load_read_u64(source->fds[i], &millidegrees) == 0)
+            temp = MAX(temp, (int) ((millidegrees + 500) / 1000));
+    }
+    return temp;
+}
+
+/* NVML returns 0 on success, only the first device is read */
+static int nvml_open(void) {
+    if (nvml.library != NULL)
+        return 0;
+    void* library = dlopen(NVML_LIBRARY, RTLD_NOW | RTLD_LOCAL);
+    if (library == NULL)
+        return -1;
+    int (*init)(void) = dlsym(library, "nvmlInit_v2");
+    int (*get_handle)(unsigned int, void**) = dlsym(library,
+            "nvmlDeviceGetHandleByIndex_v2");
+    nvml.shutdown = dlsym(library, "nvmlShutdown");
+    nvml.get_temperature = dlsym(library, "nvmlDeviceGetTemperature");
+    if (init == NULL || get_handle == NULL || nvml.shutdown == NULL
+            || nvml.get_temperature == NULL || init() != 0) {
+        dlclose(library);
+        return -1;
+    }
+    if (get_handle(0, &nvml.device) != 0) {
+        nvml.shutdown();
+        dlclose(library);
+        return -1;
+    }
+    nvml.library = library;
+    return 0;
+}
+
+static int nvml_read(void) {
+    unsigned int temp;
+    if (nvml.get_temperature(nvml.device, NVML_TEMPERATURE_GPU, &temp) != 0)
+        return -1;
+    return (int) temp;
+}
+
+/* reads the decoded registers from ec_sys, or from EC ports when ec_sys is
+ * unavailable, into a buffer indexed by register */
+static int ec_hw_read_registers(uint8_t* buf) {
+    if (ec_sysfs_fd >= 0)
+        return ec_sysfs_read(buf) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    memset(buf, 0, EC_REG_SIZE);
+    return ec_io_read_registers(ec_sample_regs, ec_sample_reg_count, buf);
+}
+
+/* compares the sample registers with the previous read and keeps them */
+static int ec_registers_changed(const uint8_t* buf, uint8_t* prev_buf) {
+    int changed = 0;
+    for (int i = 0; i < ec_sample_reg_count; i++) {
+        uint8_t reg = ec_sample_regs[i];
+        changed |= buf[reg] != prev_buf[reg];
+        prev_buf[reg] = buf[reg];
+    }
+    return changed;
+}
+
+static void ec_decode_sample(const uint8_t* buf, struct ec_sample* sample) {
+    const struct ec_profile* profile = ec_profile;
+    sample->sensor_count = profile->sensor_count;
+    sample->fan_count = profile->fan_count;
+    for (int i = 0; i < profile->sensor_count; i++)
+        sample->temps[i] = buf[profile->sensors[i].reg];
+    for (int i = 0; i < profile->fan_count; i++) {
+        const struct ec_fan_desc* fan = &profile->fans[i];
+        sample->fan_duty[i] = calculate_fan_duty(buf[fan->duty_reg]);
+        sample->fan_rpms[i] = calculate_fan_rpms(fan, buf[fan->rpms_hi_reg],
+                buf[fan->rpms_lo_reg]);
+    }
+}
+
+static int ec_query_sample(struct ec_sample* sample) {
+    uint8_t buf[EC_REG_SIZE] = { 0 };
+    int result = ec_io_read_registers(ec_sample_regs, ec_sample_reg_count, buf);
+    if (result == EXIT_SUCCESS && ec_registers_valid(buf, 0) != EXIT_SUCCESS) {
+        errno = EIO;
+        result = EXIT_FAILURE;
+    }
+    memset(sample, 0, sizeof(*sample));
+    ec_decode_sample(buf, sample);
+    return result;
+}
+
+static int ec_write_fan_duty(const struct ec_backend* backend, int fan,
+        int duty_percentage) {
+    if (duty_percentage < MIN_FAN_DUTY || duty_percentage > MAX_FAN_DUTY) {
+        printf("Wrong fan duty to write: %d\n", duty_percentage);
+        return EXIT_FAILURE;
+    }
+    return backend->write_fan_duty(fan, calculate_raw_duty(duty_percentage));
+}
+
+static int ec_hw_write_fan_duty(int fan, uint8_t raw_duty) {
+    return ec_io_do(0x99, ec_profile->fans[fan].write_port, raw_duty);
+}
+
+static void fan_writer_request(struct fan_writer* writer, int duty) {
+    if (writer->pending != 0 && writer->pending != duty)
+        writer->coalesced++;
+    writer->pending = duty;
+    writer->reapplied = 0;
+}
+
+/* writes the pending duty unless the EC already reports it (raw_duty, -1 if
+ * unknown), returns when to retry a write held back by the rate limit or 0 */
+static uint64_t fan_writer_flush(const struct ec_backend* backend,
+        struct fan_writer* writer, int fan, int raw_duty, uint64_t now_ns,
+        int quiet) {
+    // the last write must show up in the duty register, else write it again
+    if (writer->verify_duty != 0 && raw_duty >= 0) {
+        if (raw_duty == calculate_raw_duty(writer->verify_duty)) {
+            writer->verify_duty = 0;
+            writer->reapplied = 0;
+        } else if (now_ns - writer->last_write_ns >= FAN_WRITE_VERIFY_NS) {
+            if (!quiet)
+                printf("%s fan duty %d%% not applied, EC reports %d%%\n",
+                        ec_profile->fans[fan].name, writer->verify_duty,
+                        calculate_fan_duty(raw_duty));
+            writer->unverified++;
+            if (writer->pending == 0 && !writer->reapplied) {
+                writer->pending = writer->verify_duty;
+                writer->reapplied = 1;
+            }
+            writer->verify_duty = 0;
+        }
+    }
+    if (writer->pending == 0)
+        return 0;
+    if (raw_duty == calculate_raw_duty(writer->pending)) {
+        writer->suppressed++;
+        writer->pending = 0;
+        return 0;
+    }
+    uint64_t next_ns = writer->last_write_ns
+            + config.fan_write_interval_ms * 1000000ULL;
+    if (writer->last_write_ns != 0 && now_ns < next_ns)
+        return next_ns;
+    writer->last_write_ns = now_ns;
+    if (ec_write_fan_duty(backend, fan, writer->pending) != EXIT_SUCCESS) {
+        // kept pending, retried after the write interval
+        writer->failed++;
+        return now_ns + MAX(config.fan_write_interval_ms, 1) * 1000000ULL;
+    }
+    writer->issued++;
+    writer->verify_duty = writer->pending;
+    writer->pending = 0;
+    return 0;
+}
+
+static int ec_io_wait(const EcIoPhase phase, const uint32_t port,
+        const uint32_t flag, const char value) {
+    struct ec_io_phase_stats* stats = &ec_io_stats[phase];
+    stats->count++;
+    uint8_t data = inb(port);
+    if (((data >> flag) & 0x1) == value) {
+        stats->spun++;
+        return EXIT_SUCCESS;
+    }
+    uint64_t begin_ns = get_monotonic_ns();
+    int ready = 0;
+    for (int spin = 0; spin < EC_IO_SPIN_COUNT && !ready; spin++) {
+        __builtin_ia32_pause();
+        data = inb(port);
+        ready = ((data >> flag) & 0x1) == value;
+    }
+    if (ready)
+        stats->spun++;
+    uint64_t elapsed_ns = get_monotonic_ns() - begin_ns;
+    long backoff_ns = EC_IO_BACKOFF_MIN_NS;
+    while (!ready && elapsed_ns < EC_IO_TIMEOUT_NS) {
+        struct timespec ts = { 0, backoff_ns };
+        nanosleep(&ts, NULL);
+        stats->sleeps++;
+        backoff_ns = MIN(backoff_ns * 2, EC_IO_BACKOFF_MAX_NS);
+        data = inb(port);
+        ready = ((data >> flag) & 0x1) == value;
+        elapsed_ns = get_monotonic_ns() - begin_ns;
+    }
+    stats->total_ns += elapsed_ns;
+    stats->max_ns = MAX(stats->max_ns, elapsed_ns);
+    if (!ready) {
+        stats->timeouts++;
+        printf("wait_ec error in %s on port 0x%x after %luus, data=0x%x, "
+                "flag=0x%x, value=0x%x\n", ec_io_phase_names[phase], port,
+                (unsigned long) (elapsed_ns / 1000), data, flag, value);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void ec_io_print_stats(void) {
+    for (int i = 0; i < EC_IO_PHASE_COUNT; i++) {
+        struct ec_io_phase_stats* stats = &ec_io_stats[i];
+        if (stats->count == 0)
+            continue;
+        printf("EC %-4s waits=%lu spun=%lu sleeps=%lu timeouts=%lu "
+                "avg=%.1fus max=%.1fus\n", ec_io_phase_names[i],
+                (unsigned long) stats->count, (unsigned long) stats->spun,
+                (unsigned long) stats->sleeps, (unsigned long) stats->timeouts,
+                stats->total_ns / 1000.0 / stats->count,
+                stats->max_ns / 1000.0);
+    }
+    if (ec_io_errors.retries + ec_io_errors.failures + ec_io_errors.rejected
+            > 0)
+        printf("EC errors retries=%lu failures=%lu rejected=%lu\n",
+                (unsigned long) ec_io_errors.retries,
+                (unsigned long) ec_io_errors.failures,
+                (unsigned long) ec_io_errors.rejected);
+}
+
+/* a transaction with a timed out handshake is repeated as a whole, errno is
+ * ETIMEDOUT when every attempt failed */
+static int ec_io_read(const uint32_t port, uint8_t* value) {
+    for (int attempt = 0; attempt < EC_IO_ATTEMPTS; attempt++) {
+        if (attempt > 0)
+            ec_io_retry_wait(attempt);
+        if (ec_io_read_once(port, value) == EXIT_SUCCESS)
+            return EXIT_SUCCESS;
+    }
+    ec_io_errors.failures++;
+    errno = ETIMEDOUT;
+    return EXIT_FAILURE;
+}
+
+static int ec_io_read_once(const uint32_t port, uint8_t* value) {
+    if (ec_io_wait(EC_IO_PHASE_CMD, EC_SC, IBF, 0) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    outb(EC_SC_READ_CMD, EC_SC);
+
+    if (ec_io_wait(EC_IO_PHASE_ADDR, EC_SC, IBF, 0) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    outb(port, EC_DATA);
+
+    //wait_ec(EC_SC, EC_SC_IBF_FREE);
+    if (ec_io_wait(EC_IO_PHASE_READ, EC_SC, OBF, 1) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    *value = inb(EC_DATA);
+
+    return EXIT_SUCCESS;
+}
+
+/* reads registers one transaction each into a buffer indexed by register, so
+ * an interruption never leaves the EC mid-way */
+static int ec_io_read_registers(const uint8_t* regs, int count, uint8_t* buf) {
+    for (int i = 0; i < count; i++) {
+        if (ec_io_read(regs[i], &buf[regs[i]]) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int ec_io_do(const uint32_t cmd, const uint32_t port,
+        const uint8_t value) {
+    for (int attempt = 0; attempt < EC_IO_ATTEMPTS; attempt++) {
+        if (attempt > 0)
+            ec_io_retry_wait(attempt);
+        if (ec_io_do_once(cmd, port, value) == EXIT_SUCCESS)
+            return EXIT_SUCCESS;
+    }
+    ec_io_errors.failures++;
+    errno = ETIMEDOUT;
+    return EXIT_FAILURE;
+}
+
+static int ec_io_do_once(const uint32_t cmd, const uint32_t port,
+        const uint8_t value) {
+    if (ec_io_wait(EC_IO_PHASE_CMD, EC_SC, IBF, 0) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    outb(cmd, EC_SC);
+
+    if (ec_io_wait(EC_IO_PHASE_ADDR, EC_SC, IBF, 0) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    outb(port, EC_DATA);
+
+    if (ec_io_wait(EC_IO_PHASE_DATA, EC_SC, IBF, 0) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    outb(value, EC_DATA);
+
+    return ec_io_wait(EC_IO_PHASE_DONE, EC_SC, IBF, 0);
+}
+
+/* backs off before another attempt and drops a stale byte left in the output
+ * buffer by the aborted transaction */
+static void ec_io_retry_wait(int attempt) {
+    ec_io_errors.retries++;
+    struct timespec ts = { 0, EC_IO_RETRY_BACKOFF_NS << (attempt - 1) };
+    nanosleep(&ts, NULL);
+    if ((inb(EC_SC) >> OBF) & 0x1)
+        inb(EC_DATA);
+}
+
+/* rejects readings no working EC reports, so that auto mode never acts on a
+ * transfer error; quiet leaves the reason unlogged */
+static int ec_registers_valid(const uint8_t* buf, int quiet) {
+    for (int i = 0; i < ec_profile->sensor_count; i++) {
+        int temp = buf[ec_profile->sensors[i].reg];
+        if (temp > EC_MAX_VALID_TEMP) {
+            if (!quiet)
+                printf("rejected EC sample, %s temperature %d°C\n",
+                        ec_profile->sensors[i].name, temp);
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < ec_profile->fan_count; i++) {
+        const struct ec_fan_desc* fan = &ec_profile->fans[i];
+        int rpms = calculate_fan_rpms(fan, buf[fan->rpms_hi_reg],
+                buf[fan->rpms_lo_reg]);
+        if (rpms > fan->max_rpms * EC_MAX_VALID_RPMS_PERCENT / 100) {
+            if (!quiet)
+                printf("rejected EC sample, %s fan at %d RPM\n", fan->name,
+                        rpms);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+static int calculate_fan_duty(int raw_duty) {
+    return (int) ((double) raw_duty / 255.0 * 100.0);
+}
+
+static int calculate_raw_duty(int duty_percentage) {
+    return (int) (((double) duty_percentage) / 100.0 * 255.0);
+}
+
+static int calculate_fan_rpms(const struct ec_fan_desc* fan, int raw_rpm_high,
+        int raw_rpm_low) {
+    int raw_rpm = (raw_rpm_high << 8) + raw_rpm_low;
+    return raw_rpm > 0 ? (fan->rpm_factor / raw_rpm) : 0;
+}
+
+static int socket_open(void) {
+    for (int i = 0; i < SOCKET_MAX_CLIENTS; i++)
+        socket_clients[i].fd = -1;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path =
+            SOCKET_PATH };
+    socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+            0);
+    if (socket_fd < 0)
+        return EXIT_FAILURE;
+    // only one instance is running, so an existing socket is stale
+    unlink(SOCKET_PATH);
+    if (bind(socket_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+            || listen(socket_fd, SOCKET_MAX_CLIENTS) != 0) {
+        close(socket_fd);
+        socket_fd = -1;
+        return EXIT_FAILURE;
+    }
+    struct group* group = getgrnam(SOCKET_GROUP);
+    if (group != NULL && chown(SOCKET_PATH, 0, group->gr_gid) == 0)
+        chmod(SOCKET_PATH, 0660);
+    else
+        chmod(SOCKET_PATH, 0600);
+    return EXIT_SUCCESS;
+}
+
+static void socket_close(void) {
+    if (socket_fd < 0)
+        return;
+    for (int i = 0; i < SOCKET_MAX_CLIENTS; i++) {
+        if (socket_clients[i].fd >= 0)
+            close(socket_clients[i].fd);
+        socket_clients[i].fd = -1;
+    }
+    close(socket_fd);
+    socket_fd = -1;
+    unlink(SOCKET_PATH);
+}
+
+static void socket_accept(void) {
+    int fd = accept4(socket_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+        return;
+    for (int i = 0; i < SOCKET_MAX_CLIENTS; i++) {
+        if (socket_clients[i].fd < 0) {
+            socket_clients[i].fd = fd;
+            socket_clients[i].len = 0;
+            return;
+        }
+    }
+    printf("too many socket clients\n");
+    close(fd);
+}
+
+/* handles every complete request received from the client, returns 1 if a
+ * command was applied */
+static int socket_client_read(struct socket_client* client,
+        struct ec_sample* sample) {
+    ssize_t len = read(client->fd, client->buf + client->len,
+            sizeof(client->buf) - client->len);
+    if (len <= 0) {
+        if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+            close(client->fd);
+            client->fd = -1;
+        }
+        return 0;
+    }
+    client->len += len;
+    int applied = 0;
+    while (client->len > 0 && client->fd >= 0) {
+        int used;
+        if ((uint8_t) client->buf[0] == SOCKET_MAGIC) {
+            struct socket_request request;
+            if (client->len < (int) sizeof(request))
+                break;
+            memcpy(&request, client->buf, sizeof(request));
+            used = sizeof(request);
+            applied |= socket_client_binary(client, &request, sample);
+        } else {
+            char* eol = memchr(client->buf, '\n', client->len);
+            if (eol == NULL) {
+                if (client->len == sizeof(client->buf)) {
+                    close(client->fd);
+                    client->fd = -1;
+                }
+                break;
+            }
+            *eol = '\0';
+            used = eol - client->buf + 1;
+            applied |= socket_client_text(client, client->buf, sample);
+        }
+        memmove(client->buf, client->buf + used, client->len - used);
+        client->len -= used;
+    }
+    return applied;
+}
+
+static int socket_client_binary(struct socket_client* client,
+        const struct socket_request* request, struct ec_sample* sample) {
+    struct socket_response response = { SOCKET_MAGIC, SOCKET_VERSION,
+            request->op, 0 };
+    struct ec_command command = { 0, request->value };
+    if (request->version != SOCKET_VERSION)
+        response.status = EPROTO;
+    else if (request->op == SOCKET_OP_AUTO)
+        command.type = EC_COMMAND_AUTO;
+    else if (request->op == SOCKET_OP_DUTY)
+        command.type = EC_COMMAND_MANUAL;
+    else if (request->op != SOCKET_OP_GET)
+        response.status = EINVAL;
+    if (command.type != 0
+            && main_ec_worker_command(sample, &command) != EXIT_SUCCESS)
+        response.status = EINVAL;
+    response.sample_version = share_sample_version();
+    response.sample = *sample;
+    socket_client_send(client, &response, sizeof(response));
+    return command.type != 0 && response.status == 0;
+}
+
+static int socket_client_text(struct socket_client* client, char* line,
+        struct ec_sample* sample) {
+    line[strcspn(line, "\r")] = '\0';
+    char reply[512];
+    struct ec_command command = { 0, 0 };
+    char arg[16];
+    if (strcmp(line, "get") == 0) {
+        // "<sensor>_temp" per sensor, "fan_" for the first fan, "fan2_"...
+        int len = snprintf(reply, sizeof(reply), "version=%u",
+                share_sample_version());
+        for (int i = 0; i < ec_profile->sensor_count; i++)
+            len += snprintf(reply + len, sizeof(reply) - len, " %s_temp=%d",
+                    ec_profile->sensors[i].name, sample->temps[i]);
+        for (int i = 0; i < ec_profile->fan_count; i++) {
+            char fan[8] = "fan";
+            if (i > 0)
+                snprintf(fan, sizeof(fan), "fan%d", i + 1);
+            len += snprintf(reply + len, sizeof(reply) - len,
+                    " %s_duty=%d %s_rpms=%d", fan, sample->fan_duty[i], fan,
+                    sample->fan_rpms[i]);
+        }
+        len += snprintf(reply + len, sizeof(reply) - len,
+                " auto_duty=%d auto_duty_val=%d", sample->auto_duty,
+                sample->auto_duty_val[0]);
+        for (int i = 1; i < ec_profile->fan_count; i++)
+            len += snprintf(reply + len, sizeof(reply) - len,
+                    " fan%d_auto_duty_val=%d", i + 1, sample->auto_duty_val[i]);
+        snprintf(reply + len, sizeof(reply) - len, " manual_duty=%d "
+                "cpu_load=%d gpu_load=%d package_power_mw=%d control=%s\n",
+                sample->manual_duty, sample->cpu_load, sample->gpu_load,
+                sample->package_power_mw,
+                sample->control == CONTROL_PID ? "pid" : "curve");
+    } else if (strcmp(line, "stats") == 0) {
+        // "<phase>_p50_us", "<phase>_p99_us" and "<phase>_max_us" per phase
+        const struct ec_stats* stats = &share_info->stats;
+        int len = snprintf(reply, sizeof(reply), "ticks=%llu",
+                atomic_load_explicit(&stats->ticks, memory_order_relaxed));
+        for (int i = 0; i < EC_STATS_PHASES; i++) {
+            const struct ec_stats_histogram* histogram = &stats->phases[i];
+            len += snprintf(reply + len, sizeof(reply) - len,
+                    " %s_p50_us=%llu %s_p99_us=%llu %s_max_us=%llu",
+                    stats_phase_names[i],
+                    (unsigned long long) stats_percentile_us(histogram, 0.5),
+                    stats_phase_names[i],
+                    (unsigned long long) stats_percentile_us(histogram, 0.99),
+                    stats_phase_names[i],
+                    atomic_load_explicit(&histogram->max_ns,
+                            memory_order_relaxed) / 1000);
+        }
+        unsigned long long timeouts = 0;
+        unsigned long long writes = 0;
+        for (int i = 0; i < EC_STATS_IO_PHASES; i++)
+            timeouts += atomic_load_explicit(&stats->io_timeouts[i],
+                    memory_order_relaxed);
+        for (int i = 0; i < EC_MAX_FANS; i++)
+            writes += atomic_load_explicit(&stats->fan_writes_issued[i],
+                    memory_order_relaxed);
+        snprintf(reply + len, sizeof(reply) - len,
+                " ec_timeouts=%llu fan_writes=%llu\n", timeouts, writes);
+    } else if (strcmp(line, "auto") == 0) {
+        command.type = EC_COMMAND_AUTO;
+    } else if (sscanf(line, "duty %15s", arg) == 1) {
+        command.type = EC_COMMAND_MANUAL;
+        command.value = atoi(arg);
+    } else if (sscanf(line, "control %15s", arg) == 1) {
+        command.type = EC_COMMAND_CONTROL;
+        command.value = strcmp(arg, "pid") == 0 ? CONTROL_PID :
+                strcmp(arg, "curve") == 0 ? CONTROL_CURVE : -1;
+    } else {
+        snprintf(reply, sizeof(reply), "error unknown command\n");
+    }
+    if (command.type != 0) {
+        if (main_ec_worker_command(sample, &command) == EXIT_SUCCESS) {
+            snprintf(reply, sizeof(reply), "ok\n");
+        } else {
+            snprintf(reply, sizeof(reply), "error invalid %s\n",
+                    command.type == EC_COMMAND_CONTROL ? "control" : "duty");
+            command.type = 0;
+        }
+    }
+    socket_client_send(client, reply, strlen(reply));
+    return command.type != 0;
+}
+
+/* replies are small enough for the socket buffer, a client not reading them
+ * is dropped */
+static void socket_client_send(struct socket_client* client, const void* buf,
+        size_t len) {
+    if (send(client->fd, buf, len, MSG_NOSIGNAL) != (ssize_t) len) {
+        close(client->fd);
+        client->fd = -1;
+    }
+}
+
+/* listens on "address:port" (IPv4) for HTTP scrapes */
+static int metrics_open(const char* listen_addr) {
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++)
+        metrics_clients[i].fd = -1;
+    char host[64];
+    int port;
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    if (sscanf(listen_addr, "%63[^:]:%d", host, &port) != 2 || port <= 0
+            || port > 65535 || inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        errno = EINVAL;
+        return EXIT_FAILURE;
+    }
+    addr.sin_port = htons(port);
+    metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+            0);
+    if (metrics_fd < 0)
+        return EXIT_FAILURE;
+    int one = 1;
+    setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(metrics_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+            || listen(metrics_fd, METRICS_MAX_CLIENTS) != 0) {
+        close(metrics_fd);
+        metrics_fd = -1;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void metrics_close(void) {
+    if (metrics_fd < 0)
+        return;
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (metrics_clients[i].fd >= 0)
+            close(metrics_clients[i].fd);
+        metrics_clients[i].fd = -1;
+    }
+    close(metrics_fd);
+    metrics_fd = -1;
+}
+
+static void metrics_accept(void) {
+    int fd = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+        return;
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (metrics_clients[i].fd < 0) {
+            metrics_clients[i].fd = fd;
+            metrics_clients[i].len = 0;
+            return;
+        }
+    }
+    close(fd);
+}
+
+/* any request is answered by the rendered metrics once its header ended, the
+ * client buffer keeps the last bytes to find the blank line across reads */
+static void metrics_client_read(struct socket_client* client) {
+    char buf[1024];
+    ssize_t len = read(client->fd, buf, sizeof(buf));
+    if (len <= 0) {
+        if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+            close(client->fd);
+            client->fd = -1;
+        }
+        return;
+    }
+    int done = 0;
+    for (ssize_t i = 0; i < len && !done; i++) {
+        client->buf[client->len % 4] = buf[i];
+        client->len++;
+        char tail[4];
+        for (int j = 0; j < 4; j++)
+            tail[j] = client->buf[(client->len + j) % 4];
+        done = memcmp(tail, "\r\n\r\n", 4) == 0 || memcmp(tail + 2, "\n\n", 2) == 0;
+    }
+    if (!done)
+        return;
+    struct iovec iov[] = { { metrics_header, metrics_header_len }, {
+            metrics_body, metrics_body_len } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+    shutdown(client->fd, SHUT_WR);
+    close(client->fd);
+    client->fd = -1;
+}
+
+static void metrics_render(const struct ec_sample* sample, uint64_t now_ns) {
+    char* p = metrics_body;
+    char* end = metrics_body + sizeof(metrics_body);
+    const struct ec_profile* profile = ec_profile;
+    metrics_append(&p, end,
+            "# HELP clevo_temp_celsius Temperature reported by the EC.\n"
+            "# TYPE clevo_temp_celsius gauge\n");
+    for (int i = 0; i < profile->sensor_count; i++)
+        metrics_append(&p, end, "clevo_temp_celsius{sensor=\"%s\"} %d\n",
+                profile->sensors[i].name, sample->temps[i]);
+    metrics_append(&p, end,
+            "# HELP clevo_fan_duty_percent Fan duty reported by the EC.\n"
+            "# TYPE clevo_fan_duty_percent gauge\n");
+    for (int i = 0; i < profile->fan_count; i++)
+        metrics_append(&p, end, "clevo_fan_duty_percent{fan=\"%s\"} %d\n",
+                profile->fans[i].name, sample->fan_duty[i]);
+    metrics_append(&p, end,
+            "# HELP clevo_fan_rpm Fan speed reported by the EC.\n"
+            "# TYPE clevo_fan_rpm gauge\n");
+    for (int i = 0; i < profile->fan_count; i++)
+        metrics_append(&p, end, "clevo_fan_rpm{fan=\"%s\"} %d\n",
+                profile->fans[i].name, sample->fan_rpms[i]);
+    if (sample->cpu_load >= 0)
+        metrics_append(&p, end,
+                "# HELP clevo_cpu_load_percent CPU utilization.\n"
+                "# TYPE clevo_cpu_load_percent gauge\n"
+                "clevo_cpu_load_percent %d\n", sample->cpu_load);
+    if (sample->gpu_load >= 0)
+        metrics_append(&p, end,
+                "# HELP clevo_gpu_load_percent GPU utilization.\n"
+                "# TYPE clevo_gpu_load_percent gauge\n"
+                "clevo_gpu_load_percent %d\n", sample->gpu_load);
+    if (sample->package_power_mw >= 0)
+        metrics_append(&p, end,
+                "# HELP clevo_package_power_watts RAPL package power.\n"
+                "# TYPE clevo_package_power_watts gauge\n"
+                "clevo_package_power_watts %.3f\n",
+                sample->package_power_mw / 1000.0);
+    metrics_append(&p, end,
+            "# HELP clevo_auto_mode 1 in auto mode, 0 in manual mode.\n"
+            "# TYPE clevo_auto_mode gauge\n"
+            "clevo_auto_mode %d\n"
+            "# HELP clevo_auto_duty_percent Fan duty last set by auto mode.\n"
+            "# TYPE clevo_auto_duty_percent gauge\n", sample->auto_duty);
+    for (int i = 0; i < profile->fan_count; i++)
+        metrics_append(&p, end, "clevo_auto_duty_percent{fan=\"%s\"} %d\n",
+                profile->fans[i].name, sample->auto_duty_val[i]);
+    metrics_append(&p, end,
+            "# HELP clevo_samples_total Samples published by the worker.\n"
+            "# TYPE clevo_samples_total counter\n"
+            "clevo_samples_total %u\n"
+            "# HELP clevo_fan_writes_total Fan duty writes by result.\n"
+            "# TYPE clevo_fan_writes_total counter\n",
+            share_sample_version());
+    for (int i = 0; i < profile->fan_count; i++) {
+        const char* name = profile->fans[i].name;
+        metrics_append(&p, end,
+                "clevo_fan_writes_total{fan=\"%s\",result=\"issued\"} %lu\n"
+                "clevo_fan_writes_total{fan=\"%s\",result=\"suppressed\"} %lu\n"
+                "clevo_fan_writes_total{fan=\"%s\",result=\"coalesced\"} %lu\n"
+                "clevo_fan_writes_total{fan=\"%s\",result=\"failed\"} %lu\n"
+                "clevo_fan_writes_total{fan=\"%s\",result=\"unverified\"} %lu\n",
+                name, (unsigned long) fan_writers[i].issued, name,
+                (unsigned long) fan_writers[i].suppressed, name,
+                (unsigned long) fan_writers[i].coalesced, name,
+                (unsigned long) fan_writers[i].failed, name,
+                (unsigned long) fan_writers[i].unverified);
+    }
+    metrics_append(&p, end,
+            "# HELP clevo_ec_handshakes_total EC port handshakes by phase.\n"
+            "# TYPE clevo_ec_handshakes_total counter\n");
+    for (int i = 0; i < EC_IO_PHASE_COUNT; i++)
+        metrics_append(&p, end,
+                "clevo_ec_handshakes_total{phase=\"%s\"} %lu\n",
+                ec_io_phase_names[i], (unsigned long) ec_io_stats[i].count);
+    metrics_append(&p, end,
+            "# HELP clevo_ec_handshake_timeouts_total EC port handshakes timed out by phase.\n"
+            "# TYPE clevo_ec_handshake_timeouts_total counter\n");
+    for (int i = 0; i < EC_IO_PHASE_COUNT; i++)
+        metrics_append(&p, end,
+                "clevo_ec_handshake_timeouts_total{phase=\"%s\"} %lu\n",
+                ec_io_phase_names[i], (unsigned long) ec_io_stats[i].timeouts);
+    metrics_append(&p, end,
+            "# HELP clevo_ec_errors_total EC transactions retried or failed and samples rejected.\n"
+            "# TYPE clevo_ec_errors_total counter\n"
+            "clevo_ec_errors_total{type=\"retry\"} %lu\n"
+            "clevo_ec_errors_total{type=\"failure\"} %lu\n"
+            "clevo_ec_errors_total{type=\"rejected\"} %lu\n",
+            (unsigned long) ec_io_errors.retries,
+            (unsigned long) ec_io_errors.failures,
+            (unsigned long) ec_io_errors.rejected);
+    p += metrics_render_histogram(p, end - p, "clevo_ec_read_duration_seconds",
+            "Time to read the EC registers of a sample.", &ec_read_histogram);
+    metrics_body_len = p - metrics_body;
+    metrics_header_len = snprintf(metrics_header, sizeof(metrics_header),
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %d\r\n"
+            "Connection: close\r\n\r\n", metrics_body_len);
+    if (strlen(config.metrics_textfile) > 0
+            && now_ns - metrics_textfile_ns >= METRICS_TEXTFILE_INTERVAL_NS) {
+        metrics_write_textfile(config.metrics_textfile);
+        metrics_textfile_ns = now_ns;
+    }
+}
+
+static int metrics_render_histogram(char* buf, size_t size, const char* name,
+        const char* help, const struct latency_histogram* histogram) {
+    char* p = buf;
+    char* end = buf + size;
+    p += snprintf(p, end - p, "# HELP %s %s\n# TYPE %s histogram\n", name,
+            help, name);
+    uint64_t cumulative = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS && p < end; i++) {
+        cumulative += histogram->buckets[i];
+        p += snprintf(p, end - p, "%s_bucket{le=\"%g\"} %lu\n", name,
+                (1 << i) / 1e6, (unsigned long) cumulative);
+    }
+    if (p < end)
+        p += snprintf(p, end - p,
+                "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.9f\n%s_count %lu\n",
+                name, (unsigned long) histogram->count, name,
+                histogram->sum_ns / 1e9, name,
+                (unsigned long) histogram->count);
+    return MIN(p, end - 1) - buf;
+}
+
+/* appends at *p, a truncated append leaves *p at the terminating NUL of the
+ * full buffer so that later appends write nothing */
+static void metrics_append(char** p, char* end, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(*p, end - *p, format, args);
+    va_end(args);
+    if (len > 0)
+        *p += MIN(len, end - *p - 1);
+}
+
+/* written to a temporary file and renamed, so node_exporter never reads a
+ * partial file */
+static void metrics_write_textfile(const char* path) {
+    char tmp_path[300];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    ssize_t len = write(fd, metrics_body, metrics_body_len);
+    close(fd);
+    if (len == metrics_body_len)
+        rename(tmp_path, path);
+    else
+        unlink(tmp_path);
+}
+
+static void histogram_record(struct latency_histogram* histogram,
+        uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS && us > (1ULL << bucket))
+        bucket++;
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->sum_ns += ns;
+}
+
+/* single writer, relaxed atomics keep the readers lock-free */
+static void stats_record(enum ec_stats_phase phase, uint64_t ns) {
+    struct ec_stats_histogram* histogram = &share_info->stats.phases[phase];
+    uint64_t us = ns / 1000;
+    int bucket = us;
+    if (us >= EC_STATS_SUB_BUCKETS) {
+        int msb = 63 - __builtin_clzll(us);
+        bucket = (msb - 1) * EC_STATS_SUB_BUCKETS
+                + ((us >> (msb - 2)) & (EC_STATS_SUB_BUCKETS - 1));
+        bucket = MIN(bucket, EC_STATS_BUCKETS - 1);
+    }
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1,
+            memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum_ns, ns, memory_order_relaxed);
+    if (ns > atomic_load_explicit(&histogram->max_ns, memory_order_relaxed))
+        atomic_store_explicit(&histogram->max_ns, ns, memory_order_relaxed);
+}
+
+/* records the phase since begin_ns and starts the next one */
+static void stats_phase_end(enum ec_stats_phase phase, uint64_t* begin_ns,
+        uint64_t now_ns) {
+    stats_record(phase, now_ns - *begin_ns);
+    *begin_ns = now_ns;
+}
+
+/* copies the EC handshake and fan write counters, once per tick */
+static void stats_update_counters(void) {
+    struct ec_stats* stats = &share_info->stats;
+    atomic_fetch_add_explicit(&stats->ticks, 1, memory_order_relaxed);
+    for (int i = 0; i < EC_STATS_IO_PHASES && i < EC_IO_PHASE_COUNT; i++) {
+        atomic_store_explicit(&stats->io_waits[i], ec_io_stats[i].count,
+                memory_order_relaxed);
+        atomic_store_explicit(&stats->io_timeouts[i], ec_io_stats[i].timeouts,
+                memory_order_relaxed);
+    }
+    for (int i = 0; i < ec_profile->fan_count; i++) {
+        atomic_store_explicit(&stats->fan_writes_issued[i],
+                fan_writers[i].issued, memory_order_relaxed);
+        atomic_store_explicit(&stats->fan_writes_suppressed[i],
+                fan_writers[i].suppressed, memory_order_relaxed);
+        atomic_store_explicit(&stats->fan_writes_coalesced[i],
+                fan_writers[i].coalesced, memory_order_relaxed);
+        atomic_store_explicit(&stats->fan_writes_failed[i],
+                fan_writers[i].failed, memory_order_relaxed);
+        atomic_store_explicit(&stats->fan_writes_unverified[i],
+                fan_writers[i].unverified, memory_order_relaxed);
+    }
+    atomic_store_explicit(&stats->io_retries, ec_io_errors.retries,
+            memory_order_relaxed);
+    atomic_store_explicit(&stats->io_failures, ec_io_errors.failures,
+            memory_order_relaxed);
+    atomic_store_explicit(&stats->samples_rejected, ec_io_errors.rejected,
+            memory_order_relaxed);
+}
+
+/* the upper bound of the bucket holding the quantile, 0 without records */
+static uint64_t stats_percentile_us(const struct ec_stats_histogram* histogram,
+        double quantile) {
+    unsigned long long counts[EC_STATS_BUCKETS];
+    unsigned long long total = 0;
+    for (int i = 0; i < EC_STATS_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&histogram->buckets[i],
+                memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0)
+        return 0;
+    unsigned long long rank = (unsigned long long) ceil(quantile * total);
+    unsigned long long cumulative = 0;
+    for (int i = 0; i < EC_STATS_BUCKETS - 1; i++) {
+        cumulative += counts[i];
+        if (cumulative >= rank)
+            return ec_stats_bucket_us(i + 1);
+    }
+    return ec_stats_bucket_us(EC_STATS_BUCKETS - 1);
+}
+
+/* starts a new trace and keeps the previous one as <path>.1 */
+static int trace_open(const char* path) {
+    char old_path[300];
+    snprintf(old_path, sizeof(old_path), "%s.1", path);
+    if (rename(path, old_path) != 0 && errno != ENOENT)
+        return EXIT_FAILURE;
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+            0644);
+    if (trace_fd < 0)
+        return EXIT_FAILURE;
+    struct trace_header header = { .magic = TRACE_MAGIC, .version =
+            TRACE_VERSION, .record_size = sizeof(struct trace_record),
+            .sensor_count = ec_profile->sensor_count, .fan_count =
+                    ec_profile->fan_count };
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.start_realtime_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    header.start_monotonic_ns = get_monotonic_ns();
+    snprintf(header.profile, sizeof(header.profile), "%s", ec_profile->name);
+    for (int i = 0; i < ec_profile->sensor_count; i++)
+        strncpy(header.sensor_names[i], ec_profile->sensors[i].name,
+                EC_NAME_SIZE - 1);
+    for (int i = 0; i < ec_profile->fan_count; i++)
+        strncpy(header.fan_names[i], ec_profile->fans[i].name,
+                EC_NAME_SIZE - 1);
+    if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+        close(trace_fd);
+        trace_fd = -1;
+        return EXIT_FAILURE;
+    }
+    trace_size = sizeof(header);
+    trace_count = 0;
+    trace_flush_ns = header.start_monotonic_ns;
+    return EXIT_SUCCESS;
+}
+
+static void trace_append(const struct ec_sample* sample, uint64_t now_ns) {
+    struct trace_record* record = &trace_buf[trace_count++];
+    memset(record, 0, sizeof(*record));
+    record->timestamp_ns = now_ns;
+    for (int i = 0; i < EC_MAX_SENSORS; i++)
+        record->temps[i] = sample->temps[i];
+    for (int i = 0; i < EC_MAX_FANS; i++) {
+        record->fan_rpms[i] = sample->fan_rpms[i];
+        record->fan_duty[i] = sample->fan_duty[i];
+        record->commanded[i] = sample->auto_duty ? sample->auto_duty_val[i] :
+                sample->manual_duty;
+    }
+    record->mode = sample->auto_duty ? TRACE_MODE_AUTO : TRACE_MODE_MANUAL;
+    record->cpu_load = sample->cpu_load >= 0 ? sample->cpu_load : 255;
+    record->gpu_load = sample->gpu_load >= 0 ? sample->gpu_load : 255;
+    record->package_power_dw = sample->package_power_mw >= 0 ?
+            MIN(sample->package_power_mw / 100, 0xFFFE) : 0xFFFF;
+    if (trace_count < TRACE_BUF_RECORDS
+            && now_ns - trace_flush_ns < TRACE_FLUSH_NS)
+        return;
+    trace_flush();
+    trace_flush_ns = now_ns;
+    if (trace_fd >= 0 && trace_size >= config.trace_max_mb * 1048576ULL) {
+        close(trace_fd);
+        trace_fd = -1;
+        if (trace_open(config.trace_file) != EXIT_SUCCESS)
+            printf("unable to rotate trace %s: %s\n", config.trace_file,
+                    strerror(errno));
+    }
+}
+
+/* a failed write stops recording instead of retrying every sample */
+static void trace_flush(void) {
+    size_t len = trace_count * sizeof(struct trace_record);
+    trace_count = 0;
+    if (trace_fd < 0 || len == 0)
+        return;
+    if (write(trace_fd, trace_buf, len) != (ssize_t) len) {
+        printf("unable to write trace: %s\n", strerror(errno));
+        close(trace_fd);
+        trace_fd = -1;
+        return;
+    }
+    trace_size += len;
+}
+
+static void trace_close(void) {
+    if (trace_fd < 0)
+        return;
+    trace_flush();
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+/* runs the modes that only work on files given by the caller, with the
+ * caller's own privileges so a path never opens what only root could;
+ * returns -1 for every other mode */
+static int main_offline(int argc, char* argv[]) {
+    static const char* const modes[] = { "--export-csv", "--replay",
+            "--simulate", "--synthesize" };
+    int offline = 0;
+    for (int i = 0; argc > 2 && i < sizeof(modes) / sizeof(modes[0]); i++)
+        offline |= strcmp(argv[1], modes[i]) == 0;
+    if (!offline)
+        return -1;
+    if (main_drop_privileges() != EXIT_SUCCESS) {
+        printf("unable to drop privileges: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (strcmp(argv[1], "--export-csv") == 0)
+        return main_trace_read(argv[2], 0, 0);
+    if (strcmp(argv[1], "--simulate") == 0)
+        return main_simulate(argv[2], argc > 3 ? argv[3] : CONFIG_PATH);
+    if (strcmp(argv[1], "--synthesize") == 0) {
+        int seconds = argc > 3 ? atoi(argv[3]) : SYNTH_SECONDS;
+        if (seconds <= 0) {
+            printf("invalid trace length %s!\n", argv[3]);
+            return EXIT_FAILURE;
+        }
+        return main_synthesize(argv[2], seconds);
+    }
+    double speed = argc > 3 ? atof(argv[3]) : 1.0;
+    if (speed <= 0) {
+        printf("invalid replay speed %s!\n", argv[3]);
+        return EXIT_FAILURE;
+    }
+    return main_trace_read(argv[2], 1, speed);
+}
+
+/* gives up the setuid root for good, the group first while still allowed */
+static int main_drop_privileges(void) {
+    if (setgid(getgid()) != 0 || setuid(getuid()) != 0)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+/* prints a trace as CSV, or as dump lines paced by the recorded timestamps
+ * divided by speed */
+static int main_trace_read(const char* path, int replay, double speed) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        printf("unable to open trace %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct trace_header header;
+    if (trace_read_header(fp, &header) != EXIT_SUCCESS) {
+        printf("%s is not a supported trace\n", path);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    if (replay) {
+        time_t start = header.start_realtime_ns / 1000000000ULL;
+        char s_time[64];
+        strftime(s_time, sizeof(s_time), "%Y-%m-%d %H:%M:%S",
+                localtime(&start));
+        printf("Replay trace of %s, profile %s\n", s_time, header.profile);
+    } else {
+        printf("time_s");
+        for (int i = 0; i < header.sensor_count; i++)
+            printf(",%s_temp", header.sensor_names[i]);
+        for (int i = 0; i < header.fan_count; i++)
+            printf(",%s_fan_duty,%s_fan_rpms,%s_fan_commanded",
+                    header.fan_names[i], header.fan_names[i],
+                    header.fan_names[i]);
+        printf(",mode,cpu_load,gpu_load,package_power_w\n");
+    }
+    static struct trace_record records[TRACE_BUF_RECORDS];
+    size_t count;
+    uint64_t prev_ns = 0;
+    while ((count = fread(records, sizeof(records[0]), TRACE_BUF_RECORDS, fp))
+            > 0) {
+        for (size_t i = 0; i < count; i++) {
+            const struct trace_record* record = &records[i];
+            double time_s = (double) (record->timestamp_ns
+                    - header.start_monotonic_ns) / 1e9;
+            if (!replay) {
+                printf("%.3f", time_s);
+                for (int j = 0; j < header.sensor_count; j++)
+                    printf(",%d", record->temps[j]);
+                for (int j = 0; j < header.fan_count; j++)
+                    printf(",%d,%d,%d", record->fan_duty[j],
+                            record->fan_rpms[j], record->commanded[j]);
+                printf(",%s,", record->mode == TRACE_MODE_AUTO ? "auto" : "manual");
+                // unavailable or unrecorded loads are left empty
+                int loads = header.version >= 2;
+                if (loads && record->cpu_load != 255)
+                    printf("%d", record->cpu_load);
+                printf(",");
+                if (loads && record->gpu_load != 255)
+                    printf("%d", record->gpu_load);
+                printf(",");
+                if (loads && record->package_power_dw != 0xFFFF)
+                    printf("%.1f", record->package_power_dw / 10.0);
+                printf("\n");
+                continue;
+            }
+            if (prev_ns != 0 && record->timestamp_ns > prev_ns) {
+                uint64_t delay_ns = (record->timestamp_ns - prev_ns) / speed;
+                struct timespec delay = { delay_ns / 1000000000ULL, delay_ns
+                        % 1000000000ULL };
+                nanosleep(&delay, NULL);
+            }
+            prev_ns = record->timestamp_ns;
+            printf("%10.3fs", time_s);
+            for (int j = 0; j < header.sensor_count; j++)
+                printf(" %s=%d°C", header.sensor_names[j], record->temps[j]);
+            for (int j = 0; j < header.fan_count; j++)
+                printf(" %s_fan=%d%%/%dRPM", header.fan_names[j],
+                        record->fan_duty[j], record->fan_rpms[j]);
+            if (record->mode == TRACE_MODE_AUTO)
+                printf(" auto\n");
+            else
+                printf(" manual %d%%\n", record->commanded[0]);
+            fflush(stdout);
+        }
+    }
+    fclose(fp);
+    return EXIT_SUCCESS;
+}
+
+/* reads and checks the header, names are NUL-terminated */
+static int trace_read_header(FILE* fp, struct trace_header* header) {
+    if (fread(header, sizeof(*header), 1, fp) != 1
+            || header->magic != TRACE_MAGIC || header->version < 1
+            || header->version > TRACE_VERSION
+            || header->record_size != sizeof(struct trace_record)
+            || header->sensor_count > EC_MAX_SENSORS
+            || header->fan_count > EC_MAX_FANS)
+        return EXIT_FAILURE;
+    header->profile[sizeof(header->profile) - 1] = '\0';
+    for (int i = 0; i < EC_MAX_SENSORS; i++)
+        header->sensor_names[i][EC_NAME_SIZE - 1] = '\0';
+    for (int i = 0; i < EC_MAX_FANS; i++)
+        header->fan_names[i][EC_NAME_SIZE - 1] = '\0';
+    return EXIT_SUCCESS;
+}
+
+/* runs auto mode on the thermal model instead of the EC, once per controller,
+ * with the settings of config_path and the profile of the trace; the model
+ * is heated by what the recorded temperatures imply under the recorded fan
+ * RPM, so it follows the trace as long as the fans do */
+static int main_simulate(const char* path, const char* config_path) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        printf("unable to open trace %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct trace_header* header = &sim_trace.header;
+    if (trace_read_header(fp, header) != EXIT_SUCCESS) {
+        printf("%s is not a supported trace\n", path);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    size_t capacity = 0;
+    for (;;) {
+        if (sim_trace.count == capacity) {
+            capacity = MAX(capacity * 2, TRACE_BUF_RECORDS);
+            struct trace_record* records = realloc(sim_trace.records,
+                    capacity * sizeof(*records));
+            if (records == NULL) {
+                printf("unable to read trace %s: %s\n", path, strerror(errno));
+                fclose(fp);
+                return EXIT_FAILURE;
+            }
+            sim_trace.records = records;
+        }
+        size_t count = fread(sim_trace.records + sim_trace.count,
+                sizeof(*sim_trace.records), capacity - sim_trace.count, fp);
+        if (count == 0)
+            break;
+        sim_trace.count += count;
+    }
+    fclose(fp);
+    // the registers of the recorded profile, the settings of config_path
+    config_load(config_path);
+    const struct ec_profile* profile = profile_select(header->profile);
+    if (profile == NULL || profile->sensor_count != header->sensor_count
+            || profile->fan_count != header->fan_count) {
+        printf("unknown EC profile %s in %s\n", header->profile, path);
+        return EXIT_FAILURE;
+    }
+    profile_compile(profile);
+    config_apply_fans();
+    if (sim_trace.count < 2) {
+        printf("%s has no samples to simulate\n", path);
+        return EXIT_FAILURE;
+    }
+    // private history for the PID trend, in trace time
+    void* shm = mmap(NULL, sizeof(*share_info), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (shm == MAP_FAILED) {
+        printf("unable to map history: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    share_info = shm;
+    // the simulation publishes nowhere but in its private memory
+    config.metrics_textfile[0] = '\0';
+    //
+    uint64_t duration_ns = sim_trace.records[sim_trace.count - 1].timestamp_ns
+            - sim_trace.records[0].timestamp_ns;
+    time_t start = header->start_realtime_ns / 1000000000ULL;
+    char s_time[64];
+    strftime(s_time, sizeof(s_time), "%Y-%m-%d %H:%M:%S", localtime(&start));
+    printf("Simulate trace of %s, profile %s, %lu samples over %.0fs\n",
+            s_time, profile->name, (unsigned long) sim_trace.count,
+            duration_ns / 1e9);
+    printf("EC transactions of %.0fus failing at %g, threshold %.0f°C\n",
+            config.simulate_latency_us, config.simulate_failure_rate,
+            config.simulate_threshold);
+    // the recording itself as the baseline
+    memset(&sim, 0, sizeof(sim));
+    for (size_t i = 0; i + 1 < sim_trace.count; i++) {
+        const struct trace_record* record = &sim_trace.records[i];
+        uint64_t dt_ns = record[1].timestamp_ns - record->timestamp_ns;
+        int temp = record->temps[0];
+        for (int j = 1; j < profile->sensor_count; j++)
+            temp = MAX(temp, record->temps[j]);
+        int duty = 0;
+        for (int j = 0; j < profile->fan_count; j++)
+            duty += record->fan_duty[j];
+        sim.max_temp = MAX(sim.max_temp, temp);
+        if (temp > config.simulate_threshold)
+            sim.above_ns += dt_ns;
+        sim.duty_s += (double) duty / profile->fan_count * dt_ns / 1e9;
+    }
+    sim_report("recorded", duration_ns);
+    static const char* control_names[] = { "curve", "pid" };
+    for (int control = CONTROL_CURVE; control <= CONTROL_PID; control++) {
+        config.control = control;
+        sim_run();
+        sim_report(control_names[control], duration_ns);
+    }
+    free(sim_trace.records);
+    return EXIT_SUCCESS;
+}
+
+/* records the thermal model under a square load with the fans held at the
+ * minimum duty, a fixed input for --simulate without a laptop */
+static int main_synthesize(const char* path, int seconds) {
+    if (trace_open(path) != EXIT_SUCCESS) {
+        printf("unable to write trace %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct ec_sample sample = { .sensor_count = ec_profile->sensor_count,
+            .fan_count = ec_profile->fan_count, .manual_duty = MIN_FAN_DUTY,
+            .gpu_load = -1 };
+    double fractions[EC_MAX_FANS];
+    for (int i = 0; i < ec_profile->fan_count; i++) {
+        sample.fan_duty[i] = MIN_FAN_DUTY;
+        sample.fan_rpms[i] = ec_profile->fans[i].max_rpms * MIN_FAN_DUTY / 100;
+        fractions[i] = MIN_FAN_DUTY / 100.0;
+    }
+    double temps[EC_MAX_SENSORS];
+    for (int i = 0; i < ec_profile->sensor_count; i++)
+        temps[i] = SIM_AMBIENT + SYNTH_IDLE_W / sim_conductance(i, fractions);
+    uint64_t start_ns = get_monotonic_ns();
+    uint64_t end_ns = seconds * 1000000000ULL;
+    for (uint64_t t_ns = 0; t_ns <= end_ns; t_ns += SYNTH_RECORD_NS) {
+        int loaded = (t_ns / SYNTH_PHASE_NS) % 2;
+        double heat = loaded ? SYNTH_LOAD_W : SYNTH_IDLE_W;
+        for (int i = 0; i < ec_profile->sensor_count; i++)
+            sample.temps[i] = (int) round(temps[i]);
+        sample.cpu_load = loaded ? 90 : 5;
+        sample.package_power_mw = heat * 1000;
+        trace_append(&sample, start_ns + t_ns);
+        for (uint64_t step_ns = 0; step_ns < SYNTH_RECORD_NS;
+                step_ns += SIM_STEP_NS) {
+            for (int i = 0; i < ec_profile->sensor_count; i++)
+                temps[i] += SIM_STEP_NS / 1e9 / SIM_HEAT_CAPACITY
+                        * (heat - sim_conductance(i, fractions)
+                                * (temps[i] - SIM_AMBIENT));
+        }
+    }
+    trace_close();
+    printf("Wrote %ds of synthetic load to %s\n", seconds, path);
+    return EXIT_SUCCESS;
+}
+
+/* worker ticks over the whole trace, worker_tick() on the simulated backend
+ * and clock; only the ticks count as CPU time */
+static void sim_run(void) {
+    const struct trace_record* first = &sim_trace.records[0];
+    uint64_t end_ns = sim_trace.records[sim_trace.count - 1].timestamp_ns;
+    memset(&sim, 0, sizeof(sim));
+    sim.seed = SIM_SEED;
+    sim.now_ns = sim.model_ns = first->timestamp_ns;
+    for (int i = 0; i < ec_profile->sensor_count; i++)
+        sim.temps[i] = first->temps[i];
+    for (int i = 0; i < ec_profile->fan_count; i++) {
+        sim.raw_duty[i] = calculate_raw_duty(first->fan_duty[i]);
+        sim.fan_rpms[i] = first->fan_rpms[i];
+    }
+    memset(fan_writers, 0, sizeof(fan_writers));
+    memset(&ec_io_errors, 0, sizeof(ec_io_errors));
+    control_reset();
+    filter_reset();
+    atomic_store(&share_info->history_head, 0);
+    //
+    struct worker_state state = { .interval_ms = WORKER_INTERVAL_MIN_MS,
+            .prev_temp = -1, .quiet = 1 };
+    state.sample = (struct ec_sample ) { .sensor_count =
+                    ec_profile->sensor_count, .fan_count =
+                    ec_profile->fan_count, .auto_duty = 1, .cpu_load = -1,
+                    .gpu_load = -1, .package_power_mw = -1, .control =
+                    config.control };
+    state.published = state.ec_raw = state.sample;
+    while (sim.now_ns < end_ns) {
+        uint64_t tick_ns = sim.now_ns;
+        sim_advance();
+        uint64_t cpu_ns = get_thread_cpu_ns();
+        uint64_t write_deadline_ns = worker_tick(&ec_backend_sim, &state);
+        sim.cpu_ns += get_thread_cpu_ns() - cpu_ns;
+        sim.ticks++;
+        uint64_t next_ns = tick_ns + state.interval_ms * 1000000ULL;
+        if (write_deadline_ns != 0 && write_deadline_ns < next_ns)
+            next_ns = write_deadline_ns;
+        // EC transactions may have taken the simulated clock past it
+        sim.now_ns = MAX(sim.now_ns, next_ns);
+    }
+    sim_advance();
+}
+
+/* integrates the model up to the simulated clock: fans approach the RPM of
+ * their duty, sensors are heated by the trace and cooled through the fans */
+static void sim_advance(void) {
+    const struct trace_record* records = sim_trace.records;
+    while (sim.model_ns < sim.now_ns) {
+        uint64_t step_ns = MIN(SIM_STEP_NS, sim.now_ns - sim.model_ns);
+        double dt_s = step_ns / 1e9;
+        while (sim.index + 1 < sim_trace.count
+                && records[sim.index + 1].timestamp_ns <= sim.model_ns)
+            sim.index++;
+        double fractions[EC_MAX_FANS];
+        double duty = 0;
+        for (int i = 0; i < ec_profile->fan_count; i++) {
+            const struct ec_fan_desc* fan = &ec_profile->fans[i];
+            double target = calculate_fan_duty(sim.raw_duty[i]) / 100.0
+                    * fan->max_rpms;
+            sim.fan_rpms[i] += (target - sim.fan_rpms[i])
+                    * (1 - exp(-dt_s / SIM_FAN_TAU_S));
+            fractions[i] = MIN(1.0, sim.fan_rpms[i] / fan->max_rpms);
+            duty += calculate_fan_duty(sim.raw_duty[i]);
+        }
+        double max_temp = 0;
+        for (int i = 0; i < ec_profile->sensor_count; i++) {
+            double cooling = sim_conductance(i, fractions)
+                    * (sim.temps[i] - SIM_AMBIENT);
+            sim.temps[i] += dt_s / SIM_HEAT_CAPACITY * (sim_heat(i) - cooling);
+            max_temp = MAX(max_temp, sim.temps[i]);
+        }
+        sim.max_temp = MAX(sim.max_temp, max_temp);
+        if (max_temp > config.simulate_threshold)
+            sim.above_ns += step_ns;
+        sim.duty_s += duty / ec_profile->fan_count * dt_s;
+        sim.model_ns += step_ns;
+    }
+}
+
+/* heat in W that gives the recorded temperature slope of the sensor under
+ * the recorded fan RPM */
+static double sim_heat(int sensor) {
+    const struct trace_record* record = &sim_trace.records[sim.index];
+    double fractions[EC_MAX_FANS];
+    for (int i = 0; i < ec_profile->fan_count; i++)
+        fractions[i] = MIN(1.0,
+                (double) record->fan_rpms[i] / ec_profile->fans[i].max_rpms);
+    double heat = sim_conductance(sensor, fractions)
+            * (record->temps[sensor] - SIM_AMBIENT);
+    if (sim.index + 1 < sim_trace.count) {
+        const struct trace_record* next = record + 1;
+        double dt_s = (next->timestamp_ns - record->timestamp_ns) / 1e9;
+        if (dt_s > 0)
+            heat += SIM_HEAT_CAPACITY
+                    * (next->temps[sensor] - record->temps[sensor]) / dt_s;
+    }
+    return MAX(0.0, heat);
+}
+
+/* W/°C of a sensor through the fans the profile binds it to, all of them if
+ * none is */
+static double sim_conductance(int sensor, const double* fan_fractions) {
+    double fraction = -1;
+    for (int i = 0; i < ec_profile->fan_count; i++) {
+        if (ec_profile->fans[i].sensor_mask & (1u << sensor))
+            fraction = MAX(fraction, fan_fractions[i]);
+    }
+    for (int i = 0; i < ec_profile->fan_count && fraction < 0; i++)
+        fraction = MAX(fraction, fan_fractions[i]);
+    return SIM_CONDUCTANCE_IDLE + SIM_CONDUCTANCE_FAN * MAX(0.0, fraction);
+}
+
+/* load signals of the record being simulated, for feed-forward */
+static void sim_load(struct ec_sample* sample, uint64_t now_ns) {
+    const struct trace_record* record = &sim_trace.records[sim.index];
+    int loads = sim_trace.header.version >= 2;
+    sample->cpu_load = loads && record->cpu_load != 255 ?
+            record->cpu_load : -1;
+    sample->gpu_load = loads && record->gpu_load != 255 ?
+            record->gpu_load : -1;
+    sample->package_power_mw = loads && record->package_power_dw != 0xFFFF ?
+            record->package_power_dw * 100 : -1;
+}
+
+static uint64_t sim_clock(void) {
+    return sim.now_ns;
+}
+
+/* one EC transaction on the simulated clock: an attempt fails at the
+ * configured rate after the handshake timeout and is retried like
+ * ec_io_read() */
+static int sim_transaction(void) {
+    for (int attempt = 0; attempt < EC_IO_ATTEMPTS; attempt++) {
+        if (attempt > 0) {
+            ec_io_errors.retries++;
+            sim.now_ns += EC_IO_RETRY_BACKOFF_NS << (attempt - 1);
+        }
+        if ((double) rand_r(&sim.seed) / RAND_MAX
+                >= config.simulate_failure_rate) {
+            sim.now_ns += (uint64_t) (config.simulate_latency_us * 1000);
+            return EXIT_SUCCESS;
+        }
+        sim.now_ns += EC_IO_TIMEOUT_NS;
+    }
+    ec_io_errors.failures++;
+    errno = ETIMEDOUT;
+    return EXIT_FAILURE;
+}
+
+/* the sample registers as port reads would return them, one transaction
+ * each */
+static int sim_read_registers(uint8_t* buf) {
+    memset(buf, 0, EC_REG_SIZE);
+    for (int i = 0; i < ec_sample_reg_count; i++) {
+        if (sim_transaction() != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+    for (int i = 0; i < ec_profile->sensor_count; i++)
+        buf[ec_profile->sensors[i].reg] = MAX(0,
+                MIN((int) round(sim.temps[i]), 255));
+    for (int i = 0; i < ec_profile->fan_count; i++) {
+        const struct ec_fan_desc* fan = &ec_profile->fans[i];
+        int raw_rpm = sim.fan_rpms[i] >= 1 ?
+                MIN((int) (fan->rpm_factor / sim.fan_rpms[i]), 0xFFFF) : 0;
+        buf[fan->duty_reg] = sim.raw_duty[i];
+        buf[fan->rpms_hi_reg] = raw_rpm >> 8;
+        buf[fan->rpms_lo_reg] = raw_rpm & 0xFF;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int sim_write_fan_duty(int fan, uint8_t raw_duty) {
+    if (sim_transaction() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    sim.raw_duty[fan] = raw_duty;
+    return EXIT_SUCCESS;
+}
+
+static void sim_report(const char* name, uint64_t duration_ns) {
+    double hours = duration_ns / 3.6e12;
+    printf("  %-9s max=%.0f°C above=%.1f%% duty=%.0f%%", name, sim.max_temp,
+            duration_ns > 0 ? 100.0 * sim.above_ns / duration_ns : 0,
+            duration_ns > 0 ? sim.duty_s * 1e9 / duration_ns : 0);
+    if (sim.ticks == 0) {
+        printf("\n");
+        return;
+    }
+    uint64_t issued = 0, failed = 0;
+    for (int i = 0; i < ec_profile->fan_count; i++) {
+        issued += fan_writers[i].issued;
+        failed += fan_writers[i].failed;
+    }
+    printf(" writes/h=%.1f failed=%lu retries=%lu ticks=%lu cpu=%.2fus/tick\n",
+            hours > 0 ? issued / hours : 0, (unsigned long) failed,
+            (unsigned long) ec_io_errors.retries, (unsigned long) sim.ticks,
+            sim.cpu_ns / 1000.0 / sim.ticks);
+}
+
+/* reads "key = value" lines, '#' starts a comment; a missing file keeps the
+ * defaults */
+static int config_load(const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (fp != NULL) {
+        char line[512];
+        int line_no = 0;
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            line_no++;
+            char* comment = strchr(line, '#');
+            if (comment != NULL)
+                *comment = '\0';
+            char* eq = strchr(line, '=');
+            char key[64];
+            if (eq == NULL) {
+                if (sscanf(line, " %63s", key) == 1)
+                    printf("%s:%d: missing '='\n", path, line_no);
+                continue;
+            }
+            *eq = '\0';
+            char* value = eq + 1;
+            value[strcspn(value, "\r\n")] = '\0';
+            while (*value == ' ' || *value == '\t')
+                value++;
+            for (char* end = value + strlen(value);
+                    end > value && (end[-1] == ' ' || end[-1] == '\t'); end--)
+                end[-1] = '\0';
+            if (sscanf(line, " %63s", key) != 1
+                    || config_parse(key, value) != EXIT_SUCCESS)
+                printf("%s:%d: invalid setting\n", path, line_no);
+        }
+        fclose(fp);
+    } else if (errno != ENOENT) {
+        printf("unable to read %s: %s\n", path, strerror(errno));
+    }
+    profile_compile(config.profile != NULL ? config.profile :
+            profile_select(NULL));
+    config_apply_fans();
+    return EXIT_SUCCESS;
+}
+
+/* the slot of a per-fan setting, NULL when all slots are taken */
+static struct fan_config* config_fan(const char* name) {
+    if (strlen(name) == 0 || strlen(name) >= EC_NAME_SIZE)
+        return NULL;
+    for (int i = 0; i < EC_MAX_FANS; i++) {
+        if (strcmp(config.fans[i].name, name) == 0)
+            return &config.fans[i];
+        if (config.fans[i].name[0] == '\0') {
+            strcpy(config.fans[i].name, name);
+            return &config.fans[i];
+        }
+    }
+    return NULL;
+}
+
+/* compiles the curve and sensor binding of every profile fan, per-fan
+ * settings override the common curve and the profile binding */
+static void config_apply_fans(void) {
+    for (int i = 0; i < EC_MAX_FANS && config.fans[i].name[0] != '\0'; i++) {
+        int found = 0;
+        for (int j = 0; j < ec_profile->fan_count; j++)
+            found |= strcmp(ec_profile->fans[j].name, config.fans[i].name) == 0;
+        if (!found)
+            printf("no fan %s in EC profile %s\n", config.fans[i].name,
+                    ec_profile->name);
+    }
+    for (int i = 0; i < ec_profile->fan_count; i++) {
+        const struct ec_fan_desc* fan = &ec_profile->fans[i];
+        const struct fan_config* fan_config = NULL;
+        for (int j = 0; j < EC_MAX_FANS; j++) {
+            if (strcmp(config.fans[j].name, fan->name) == 0)
+                fan_config = &config.fans[j];
+        }
+        struct fan_control* control = &fan_controls[i];
+        if (fan_config != NULL && fan_config->curve_point_count > 0)
+            curve_compile(&control->curve, fan_config->curve_points,
+                    fan_config->curve_point_count, config.curve_step,
+                    config.curve_hysteresis);
+        else
+            curve_compile(&control->curve, config.curve_points,
+                    config.curve_point_count, config.curve_step,
+                    config.curve_hysteresis);
+        control->sensor_mask = fan->sensor_mask;
+        if (fan_config == NULL || strlen(fan_config->sensors) == 0)
+            continue;
+        unsigned mask = 0;
+        char sensors[64];
+        strcpy(sensors, fan_config->sensors);
+        for (char* name = strtok(sensors, " \t"); name != NULL;
+                name = strtok(NULL, " \t")) {
+            int j = 0;
+            while (j < ec_profile->sensor_count
+                    && strcmp(ec_profile->sensors[j].name, name) != 0)
+                j++;
+            if (j < ec_profile->sensor_count)
+                mask |= 1u << j;
+            else
+                printf("no sensor %s in EC profile %s\n", name,
+                        ec_profile->name);
+        }
+        if (mask != 0)
+            control->sensor_mask = mask;
+    }
+}
+
+static int config_parse(const char* key, const char* value) {
+    if (strcmp(key, "curve") == 0) {
+        struct curve_point points[MAX_CURVE_POINTS];
+        int count = curve_parse(value, points, MAX_CURVE_POINTS);
+        if (count <= 0)
+            return EXIT_FAILURE;
+        memcpy(config.curve_points, points, sizeof(points));
+        config.curve_point_count = count;
+    } else if (strcmp(key, "curve_type") == 0) {
+        if (strcmp(value, "step") == 0)
+            config.curve_step = 1;
+        else if (strcmp(value, "linear") == 0)
+            config.curve_step = 0;
+        else
+            return EXIT_FAILURE;
+    } else if (strcmp(key, "control") == 0) {
+        if (strcmp(value, "curve") == 0)
+            config.control = CONTROL_CURVE;
+        else if (strcmp(value, "pid") == 0)
+            config.control = CONTROL_PID;
+        else
+            return EXIT_FAILURE;
+    } else if (strcmp(key, "pid_setpoint") == 0) {
+        return config_parse_double(value, 20, 100, &config.pid_setpoint);
+    } else if (strcmp(key, "pid_kp") == 0) {
+        return config_parse_double(value, 0, 100, &config.pid_kp);
+    } else if (strcmp(key, "pid_ki") == 0) {
+        return config_parse_double(value, 0, 100, &config.pid_ki);
+    } else if (strcmp(key, "pid_kd") == 0) {
+        return config_parse_double(value, 0, 1000, &config.pid_kd);
+    } else if (strcmp(key, "pid_duty_step") == 0) {
+        double step;
+        if (config_parse_double(value, 1, 40, &step) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        config.pid_duty_step = (int) step;
+    } else if (strcmp(key, "feedforward_load") == 0) {
+        return config_parse_double(value, 0, 10, &config.feedforward_load);
+    } else if (strcmp(key, "feedforward_power") == 0) {
+        return config_parse_double(value, 0, 10, &config.feedforward_power);
+    } else if (strcmp(key, "feedforward_power_idle") == 0) {
+        return config_parse_double(value, 0, 500,
+                &config.feedforward_power_idle);
+    } else if (strcmp(key, "temp_source") == 0) {
+        if (strcmp(value, "fused") == 0)
+            config.temp_source = TEMP_SOURCE_FUSED;
+        else if (strcmp(value, "hwmon") == 0)
+            config.temp_source = TEMP_SOURCE_HWMON;
+        else if (strcmp(value, "ec") == 0)
+            config.temp_source = TEMP_SOURCE_EC;
+        else
+            return EXIT_FAILURE;
+    } else if (strcmp(key, "temp_nvml") == 0) {
+        double enabled;
+        if (config_parse_double(value, 0, 1, &enabled) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        config.temp_nvml = (int) enabled;
+    } else if (strcmp(key, "fan_write_interval_ms") == 0) {
+        double interval;
+        if (config_parse_double(value, 0, 60000, &interval) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        config.fan_write_interval_ms = (int) interval;
+    } else if (strcmp(key, "battery_interval_ms") == 0) {
+        double interval;
+        if (config_parse_double(value, WORKER_BATTERY_INTERVAL_MIN_MS, 60000,
+                &interval) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        config.battery_interval_ms = (int) interval;
+    } else if (strcmp(key, "worker_priority") == 0) {
+        double priority;
+        if (config_parse_double(value, 0, sched_get_priority_max(SCHED_FIFO),
+                &priority) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        config.worker_priority = (int) priority;
+    } else if (strcmp(key, "worker_policy") == 0) {
+        if (strcmp(value, "fifo") == 0)
+            config.worker_policy = SCHED_FIFO;
+        else if (strcmp(value, "rr") == 0)
+            config.worker_policy = SCHED_RR;
+        else
+            return EXIT_FAILURE;
+    } else if (strcmp(key, "worker_cpu") == 0) {
+        double cpu;
+        if (config_parse_double(value, -1, CPU_SETSIZE - 1, &cpu)
+                != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        config.worker_cpu = (int) cpu;
+    } else if (strcmp(key, "worker_mlock") == 0) {
+        double lock;
+        if (config_parse_double(value, 0, 1, &lock) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        config.worker_mlock = (int) lock;
+    } else if (strcmp(key, "profile") == 0) {
+        config.profile = profile_select(value);
+        if (config.profile == NULL)
+            return EXIT_FAILURE;
+    } else if (strcmp(key, "trace_file") == 0) {
+        if (strlen(value) >= sizeof(config.trace_file))
+            return EXIT_FAILURE;
+        strcpy(config.trace_file, value);
+    } else if (strcmp(key, "trace_max_mb") == 0) {
+        double size;
+        if (config_parse_double(value, 1, 4096, &size) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        config.trace_max_mb = (int) size;
+    } else if (strcmp(key, "metrics_listen") == 0) {
+        if (strlen(value) >= sizeof(config.metrics_listen))
+            return EXIT_FAILURE;
+        strcpy(config.metrics_listen, value);
+    } else if (strcmp(key, "metrics_textfile") == 0) {
+        if (strlen(value) >= sizeof(config.metrics_textfile))
+            return EXIT_FAILURE;
+        strcpy(config.metrics_textfile, value);
+    } else if (strcmp(key, "simulate_latency_us") == 0) {
+        return config_parse_double(value, 0, 100000,
+                &config.simulate_latency_us);
+    } else if (strcmp(key, "simulate_failure_rate") == 0) {
+        return config_parse_double(value, 0, 1, &config.simulate_failure_rate);
+    } else if (strcmp(key, "simulate_threshold") == 0) {
+        return config_parse_double(value, 20, 120, &config.simulate_threshold);
+    } else if (strcmp(key, "filter_median") == 0) {
+        double size;
+        if (config_parse_double(value, 1, FILTER_MAX_MEDIAN, &size)
+                != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        config.filter_median = (int) size;
+    } else if (strcmp(key, "filter_ema_ms") == 0) {
+        return config_parse_double(value, 0, 60000, &config.filter_ema_ms);
+    } else if (strcmp(key, "filter_slew") == 0) {
+        return config_parse_double(value, 0, 100, &config.filter_slew);
+    } else if (strcmp(key, "curve_hysteresis") == 0) {
+        char* endptr;
+        long hysteresis = strtol(value, &endptr, 10);
+        if (*value == '\0' || *endptr != '\0' || hysteresis < 0
+                || hysteresis > 50)
+            return EXIT_FAILURE;
+        config.curve_hysteresis = hysteresis;
+    } else if (strncmp(key, "curve_", 6) == 0 && config_fan(key + 6) != NULL) {
+        // per-fan settings as curve_<fan> and sensors_<fan>
+        struct curve_point points[MAX_CURVE_POINTS];
+        int count = curve_parse(value, points, MAX_CURVE_POINTS);
+        if (count <= 0)
+            return EXIT_FAILURE;
+        struct fan_config* fan_config = config_fan(key + 6);
+        memcpy(fan_config->curve_points, points, sizeof(points));
+        fan_config->curve_point_count = count;
+    } else if (strncmp(key, "sensors_", 8) == 0
+            && config_fan(key + 8) != NULL) {
+        if (strlen(value) >= sizeof(config.fans[0].sensors))
+            return EXIT_FAILURE;
+        strcpy(config_fan(key + 8)->sensors, value);
+    } else {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int config_parse_double(const char* value, double min, double max,
+        double* result) {
+    char* endptr;
+    double d = strtod(value, &endptr);
+    if (*value == '\0' || *endptr != '\0' || d < min || d > max)
+        return EXIT_FAILURE;
+    *result = d;
+    return EXIT_SUCCESS;
+}
+
+/* held until every process of this instance exits, the kernel releases it
+ * so a crashed instance never leaves a stale lock */
+static int main_lock(void) {
+    int lock_fd = open(LOCK_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0)
+        return EXIT_FAILURE;
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        int flock_errno = errno;
+        close(lock_fd);
+        errno = flock_errno;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* sends one text command to the running instance and prints its reply */
+static int main_forward_command(const char* line) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path =
+            SOCKET_PATH };
+    struct timeval timeout = { 1, 0 };
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return EXIT_FAILURE;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+            || send(fd, line, strlen(line), MSG_NOSIGNAL)
+                    != (ssize_t) strlen(line)) {
+        printf("unable to reach running instance at %s: %s\n", SOCKET_PATH,
+                strerror(errno));
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    char reply[256];
+    int len = 0;
+    while (len < (int) sizeof(reply) - 1
+            && (len == 0 || reply[len - 1] != '\n')) {
+        ssize_t n = read(fd, reply + len, sizeof(reply) - 1 - len);
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    close(fd);
+    reply[len] = '\0';
+    printf("%s", reply);
+    if (len == 0 || reply[len - 1] != '\n')
+        printf("\n");
+    return strncmp(reply, "ok", 2) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int compare_uint64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t get_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t get_thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* like CLOCK_MONOTONIC, but also counting the time suspended */
+static uint64_t get_boottime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 static void get_time_string(char* buffer, size_t max, const char* format) {